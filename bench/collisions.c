@@ -0,0 +1,65 @@
+// Adversarial scenario: recipe and ingredient names that all fall into the same
+// bucket of the unkeyed FNV hash the shop used to have, followed by orders
+// that look every one of them up.
+//
+// usage: collisions [names] > trace.txt
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define HASHMAP_CAPACITY 32771
+#define NAME_LENGTH 12
+
+size_t fnv_hash(char *key) {
+    size_t hash = 2166136261;
+    size_t prime = 16777219;
+
+    while (*key != '\0') {
+        hash ^= (size_t)(*key);
+        hash *= prime;
+        key++;
+    }
+    return hash % HASHMAP_CAPACITY;
+}
+
+// Fills names with count random words hashing to the given bucket
+void colliding_names(char names[][NAME_LENGTH + 1], int count, char prefix,
+                     size_t bucket) {
+    for (int found = 0; found < count;) {
+        names[found][0] = prefix;
+        for (int i = 1; i < NAME_LENGTH; i++)
+            names[found][i] = 'a' + rand() % 26;
+        names[found][NAME_LENGTH] = '\0';
+        if (fnv_hash(names[found]) == bucket)
+            found++;
+    }
+}
+
+int main(int argc, char **argv) {
+    int count = argc > 1 ? atoi(argv[1]) : 2000;
+    int ingredients = count / 10 > 0 ? count / 10 : 1;
+    char(*recipe_names)[NAME_LENGTH + 1] = malloc(count * sizeof(*recipe_names));
+    char(*ingredient_names)[NAME_LENGTH + 1] =
+            malloc(ingredients * sizeof(*ingredient_names));
+
+    srand(1);
+    colliding_names(recipe_names, count, 'r', 0);
+    colliding_names(ingredient_names, ingredients, 'i', 0);
+
+    printf("100 100000\n");
+    for (int i = 0; i < count; i++)
+        printf("aggiungi_ricetta %s %s %d %s %d\n", recipe_names[i],
+               ingredient_names[i % ingredients], 1 + i % 7,
+               ingredient_names[(i * 7 + 1) % ingredients], 1 + i % 5);
+    for (int i = 0; i < ingredients; i++)
+        printf("rifornimento %s %d %d\n", ingredient_names[i], 1000000,
+               1000000000);
+    for (int round = 0; round < 10; round++)
+        for (int i = 0; i < count; i++)
+            printf("ordine %s %d\n", recipe_names[(i * 31 + round) % count],
+                   1 + round);
+
+    free(recipe_names);
+    free(ingredient_names);
+    return 0;
+}
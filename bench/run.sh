@@ -0,0 +1,53 @@
+#!/bin/sh
+# Runs a benchmark scenario and reports its duration, the hash table
+# statistics of the shop and its profile per command type: throughput and,
+# where the kernel lets perf_event_open count them, cycles, instructions,
+# cache misses, branch misses and page faults.
+#
+# usage: [TARGET=pgo] bench/run.sh collisions [names]
+#        [TARGET=pgo] bench/run.sh mixed [seed] [commands]
+set -e
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+# the release build of the Makefile, or another of its targets given in TARGET,
+# for instance TARGET=pgo
+TARGET=${TARGET:-release}
+make -s -C "$ROOT" "$TARGET" >&2
+BINARY="$ROOT/pastry_shop"
+[ "$TARGET" = release ] || BINARY="$ROOT/pastry_shop-$TARGET"
+
+case "$1" in
+collisions)
+    cc -O2 -o "$WORK/collisions" "$ROOT/bench/collisions.c"
+    "$WORK/collisions" "${2:-2000}" > "$WORK/trace.txt"
+    # with a keyed hash the colliding names spread over the table: a chain
+    # longer than this means lookups are degrading towards linear
+    MAX_CHAIN=16
+    ;;
+mixed)
+    cc -O2 -o "$WORK/traces" "$ROOT/bench/traces.c"
+    # seed 7 is not among the traces the profile-guided build is trained on
+    "$WORK/traces" "${2:-7}" "${3:-100000}" > "$WORK/trace.txt"
+    MAX_CHAIN=16
+    ;;
+*)
+    echo "usage: $0 collisions [names] | mixed [seed] [commands]" >&2
+    exit 1
+    ;;
+esac
+
+START=$(date +%s.%N)
+"$BINARY" -s -p < "$WORK/trace.txt" > /dev/null 2> "$WORK/stats.txt"
+END=$(date +%s.%N)
+
+cat "$WORK/stats.txt"
+echo "commands: $(wc -l < "$WORK/trace.txt"), time: $(awk "BEGIN { print $END - $START }") s"
+
+LONGEST=$(sed -n 's/.*longest chain //p' "$WORK/stats.txt" | sort -n | tail -1)
+if [ "$LONGEST" -gt "$MAX_CHAIN" ]; then
+    echo "longest chain $LONGEST exceeds $MAX_CHAIN" >&2
+    exit 1
+fi
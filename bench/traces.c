@@ -0,0 +1,95 @@
+// Representative scenario: a catalog built up front and then extended, restocks
+// with several lots of short and long shelf life, bursts of orders skewed
+// towards a few popular recipes, occasional removals and queries. Used as the
+// training input of the profile-guided build.
+//
+// usage: traces [seed] [commands] > trace.txt
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+uint64_t state;
+
+uint32_t next_random() {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return (uint32_t)(state >> 32);
+}
+
+uint32_t uniform(uint32_t bound) {
+    return next_random() % bound;
+}
+
+// Recipe popularity roughly follows a power law: low indexes are the popular
+// ones
+uint32_t popular(uint32_t bound) {
+    uint32_t range = bound;
+
+    while (range > 1 && uniform(4) != 0)
+        range /= 2;
+    return uniform(range);
+}
+
+void add_recipe(uint32_t recipe, uint32_t ingredients) {
+    uint32_t count = 1 + uniform(6);
+
+    printf("aggiungi_ricetta r%u", recipe);
+    for (uint32_t i = 0; i < count; i++)
+        printf(" i%u %u", (recipe * 7 + i * 13 + uniform(3)) % ingredients,
+               1 + uniform(20));
+    printf("\n");
+}
+
+int main(int argc, char **argv) {
+    uint32_t seed = argc > 1 ? atoi(argv[1]) : 1;
+    uint32_t commands = argc > 2 ? atoi(argv[2]) : 100000;
+    uint32_t recipes = 200 + commands / 100;
+    uint32_t ingredients = 50 + commands / 1000;
+    uint32_t catalog = recipes / 2;
+    uint32_t timestamp = 0;
+
+    state = 0x9e3779b97f4a7c15ULL * (seed + 1);
+    printf("%u %u\n", 50 + uniform(150), 2000 + uniform(20000));
+
+    for (; timestamp < catalog && timestamp < commands; timestamp++)
+        add_recipe(timestamp, ingredients);
+
+    while (timestamp < commands) {
+        uint32_t kind = uniform(100);
+
+        if (kind < 4) {
+            add_recipe(uniform(recipes), ingredients);
+            timestamp++;
+        } else if (kind < 6) {
+            printf("rimuovi_ricetta r%u\n", uniform(recipes));
+            timestamp++;
+        } else if (kind < 56) {
+            uint32_t lots = 1 + uniform(10);
+            uint32_t shelf_life = uniform(4) == 0 ? 50 : 2000;
+
+            printf("rifornimento");
+            for (uint32_t i = 0; i < lots; i++)
+                printf(" i%u %u %u", uniform(ingredients), 10 + uniform(500),
+                       timestamp + 1 + uniform(shelf_life));
+            printf("\n");
+            timestamp++;
+        } else if (kind < 58) {
+            uint32_t query = uniform(3);
+
+            if (query == 0)
+                printf("scorta i%u\n", uniform(ingredients));
+            else
+                printf("%s r%u\n", query == 1 ? "producibile" : "coda",
+                       popular(catalog));
+        } else {
+            uint32_t burst = 1 + uniform(6);
+
+            for (uint32_t i = 0; i < burst && timestamp < commands; i++) {
+                printf("ordine r%u %u\n", popular(catalog), 1 + uniform(5));
+                timestamp++;
+            }
+        }
+    }
+    return 0;
+}
@@ -1,26 +1,167 @@
 #include <ctype.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
 
 #define MAX_LENGTH 20
 #define HASHMAP_CAPACITY 32771
-
-typedef struct ingredient {
-    char *name;
-    size_t ing_index;
-    int32_t quantity;
-    struct ingredient *next;
-} Ingredient;
+#define RETUNE_PERIOD 64
+#define SCARCITY_WINDOW 1024
+#define ORDER_QUEUE_INITIAL_CAPACITY 64
+#define ORDER_TOMBSTONE UINT32_MAX
+#define FLIGHT_RECORDER_SIZE 256
+#define PRELOAD_MAX_WORKERS 64
+#define PRELOAD_MIN_BYTES_PER_WORKER 16384
+#define PROFILE_COUNTERS 6
+#define SHIPMENT_PREPARATION_STEPS 8
+#define RESTOCK_MAX_SHARDS 64
+#define RESTOCK_SHARD_BATCH 1024
+#define SPILL_INITIAL_CAPACITY 4096
+#define SPILL_NONE -1
+#define SPILL_RELOADING -2
+
+// Subsystems the allocated memory is accounted to
+enum memory_subsystem {
+    MEMORY_CATALOG,
+    MEMORY_WAREHOUSE,
+    MEMORY_QUEUES,
+    MEMORY_BUFFERS,
+    MEMORY_SUBSYSTEMS
+};
+
+enum command_type {
+    COMMAND_ADD_RECIPE,
+    COMMAND_REMOVE_RECIPE,
+    COMMAND_RESTOCK,
+    COMMAND_ORDER,
+    COMMAND_STOCK_QUERY,
+    COMMAND_PRODUCIBLE_QUERY,
+    COMMAND_QUEUE_QUERY,
+    COMMAND_SIMULATE,
+    COMMAND_COURIER,
+    COMMAND_OTHER,
+    COMMAND_TYPES
+};
+
+#define ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+#define SIPROUND                                                               \
+    do {                                                                       \
+        v0 += v1;                                                              \
+        v1 = ROTL(v1, 13);                                                     \
+        v1 ^= v0;                                                              \
+        v0 = ROTL(v0, 32);                                                     \
+        v2 += v3;                                                              \
+        v3 = ROTL(v3, 16);                                                     \
+        v3 ^= v2;                                                              \
+        v0 += v3;                                                              \
+        v3 = ROTL(v3, 21);                                                     \
+        v3 ^= v0;                                                              \
+        v2 += v1;                                                              \
+        v1 = ROTL(v1, 17);                                                     \
+        v1 ^= v2;                                                              \
+        v2 = ROTL(v2, 32);                                                     \
+    } while (0)
 
 typedef struct lotto {
     int32_t ingredient_quantity;
     int32_t ingredient_expiration_date;
+    struct lotto *next;
 } Lotto;
 
+// Warehouse record of an ingredient: its lots ordered by expiration date and
+// their total quantity, the restock epoch of its last supply increase, the
+// number of waiting orders whose recipe needs it and how often it has recently
+// been the reason an order could not be prepared. While it is part of an order
+// batch, the quantity the batch consumed is not yet taken from the lots and
+// the batch has to be flushed before its first lot expires. With parallel
+// restocks, only the worker of its shard touches its lots and its stock.
+typedef struct ingredient {
+    Lotto *lots;
+    int64_t stock;
+    uint32_t version;
+    int32_t waiting_orders;
+    int32_t probes;
+    int32_t failures;
+    int64_t batch_consumption;
+    int32_t batch_horizon;
+    uint32_t shard;
+} Ingredient;
+
+typedef struct restock_lot {
+    Ingredient *ingredient;
+    int32_t quantity;
+    int32_t expiration_date;
+} RestockLot;
+
+// Lots of one ingredient from one restock: they end at the given index of the
+// lots of the batch and are merged as of the timestamp of their restock
+typedef struct restock_group {
+    uint32_t end;
+    int32_t timestamp;
+} RestockGroup;
+
+typedef struct restock_batch {
+    RestockLot *lots;
+    uint32_t lot_count;
+    uint32_t lot_capacity;
+    RestockGroup *groups;
+    uint32_t group_count;
+    uint32_t group_capacity;
+} RestockBatch;
+
+// Warehouse shard applying restocks in its own thread. The main thread fills
+// one batch while the worker merges the other; both buffers are allocated and
+// accounted by the main thread, which also accounts the net memory of the lots
+// the worker created and freed once it waits for it.
+typedef struct restock_shard {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    RestockBatch filling;
+    RestockBatch applying;
+    int is_applying;
+    int is_stopping;
+    int64_t allocated[MEMORY_SUBSYSTEMS];
+} RestockShard;
+
+// Recipe compiled into a single block: the header is followed by the array of
+// ingredient handles and by the parallel array of per-unit quantities. The
+// smallest quantity found not producible is remembered along with the restock
+// epoch it was found at: it stays not producible until one of the ingredients
+// gets restocked after that epoch. The orders of the recipe in each queue are
+// counted to answer the queue queries, the spilled ones among the waiting. Those
+// are summarized by their smallest quantity and the slot of the recipe among
+// the ones with spilled orders.
 typedef struct recipe {
-    Ingredient *ingredients;
+    char name[MAX_LENGTH];
+    uint32_t handle;
+    int32_t ingredient_count;
+    int32_t weight;
+    int32_t waiting_orders;
+    int32_t ready_orders;
+    uint32_t evaluations;
+    int32_t failed_quantity;
+    uint32_t failed_epoch;
+    uint32_t spilled_orders;
+    int32_t spilled_quantity;
+    int32_t spill_slot;
+    Ingredient **ingredients;
+    int32_t *quantities;
 } Recipe;
 
 typedef struct Entry {
@@ -31,82 +172,328 @@ typedef struct Entry {
 
 typedef struct HashMap {
     Entry **table;
+    int subsystem;
 } HashMap;
 HashMap *catalog_tree = NULL;
 HashMap *warehouse_tree = NULL;
 
-typedef struct EntryInt {
-    char *key;
-    int value;
-    struct EntryInt *next;
-} EntryInt;
-
-typedef struct HashMapInt {
-    EntryInt **table;
-} HashMapInt;
+// Recipes referred to by the orders, indexed by handle
+Recipe **recipe_table = NULL;
+uint32_t recipe_table_size = 0;
+uint32_t recipe_table_capacity = 0;
+uint32_t *free_recipe_handles = NULL;
+uint32_t free_recipe_handles_count = 0;
 
+// Order packed in 16 bytes: the recipe is referred to by its handle and the
+// weight is computed once at creation
 typedef struct order {
-    char *recipe_name;
-    size_t rec_index;
+    uint32_t recipe;
     int32_t quantity;
     int32_t order_timestamp;
-    struct order *next;
+    int32_t weight;
 } Order;
-Order *orders_ready_queue = NULL;
-Order *orders_wait_queue = NULL;
-Order *orders_wait_queue_tail = NULL;
-Order *shipment_queue = NULL;
+
+// Growable ring buffer of orders. Orders leaving from the middle of the queue
+// are marked as tombstones and swept away by the compaction, so the others keep
+// their relative order.
+typedef struct order_queue {
+    Order *orders;
+    uint32_t capacity;
+    uint32_t head;
+    uint32_t count;
+    uint32_t live;
+} OrderQueue;
+OrderQueue orders_ready_queue = {NULL, 0, 0, 0, 0};
+OrderQueue orders_wait_queue = {NULL, 0, 0, 0, 0};
+
+// Cold waiting orders spilled under memory pressure to an unlinked file mapped
+// in memory, out of the resident set. Orders are only appended, the ones
+// reloaded leave a tombstone behind, and the whole file is compacted once the
+// tombstones outnumber the live orders. Spilled orders are not in arrival
+// order: reloading merges them back into the wait queue by timestamp.
+FILE *spill_file = NULL;
+// Directory of the spill files, TMPDIR (or /tmp) unless given with -d
+char *spill_directory = NULL;
+Order *spill_orders = NULL;
+uint32_t spill_capacity = 0;
+uint32_t spill_count = 0;
+uint32_t spill_live = 0;
+// Handles of the recipes with spilled orders
+uint32_t *spill_recipes = NULL;
+uint32_t spill_recipes_count = 0;
+uint32_t spill_recipes_capacity = 0;
+// Orders older than the last memory reclaim are cold
+int32_t spill_horizon = 0;
+
+// Ingredients of the current order batch, and the recipe of its last order so
+// that a run of orders for the same recipe looks it up once
+int batch_orders = 0;
+Ingredient **batch_ingredients = NULL;
+uint32_t batch_ingredients_count = 0;
+uint32_t batch_ingredients_capacity = 0;
+Recipe *batch_recipe = NULL;
+
+// Scratch buffers reused by every command
+Ingredient **parsed_ingredients = NULL;
+int32_t *parsed_quantities = NULL;
+uint32_t parsed_ingredients_capacity = 0;
+RestockLot *parsed_lots = NULL;
+uint32_t parsed_lots_capacity = 0;
+
+// Load of the next courier, prepared a few orders per command instead of all at
+// the tick: the first shipment_count ready orders, which fit in the courier,
+// kept in shipment order. Orders becoming ready among them are inserted right
+// away, pushing out the newest ones if the load gets too heavy.
+Order *shipment = NULL;
+uint32_t shipment_capacity = 0;
+uint32_t shipment_count = 0;
+int32_t shipment_weight = 0;
+int32_t courier_capacity = 0;
+
+typedef struct memory_usage {
+    size_t current;
+    size_t peak;
+} MemoryUsage;
+MemoryUsage memory_usage[MEMORY_SUBSYSTEMS];
+char *memory_subsystem_names[MEMORY_SUBSYSTEMS] = {"catalog", "warehouse",
+                                                   "queues", "buffers"};
+size_t memory_total = 0;
+// Optional budget, 0 when unlimited: exceeding it raises the memory pressure
+// flag and the memory is reclaimed before the next command
+size_t memory_budget = 0;
+size_t memory_reclaim_floor = 0;
+int memory_pressure = 0;
+
+char *command_names[COMMAND_TYPES] = {
+        "aggiungi_ricetta", "rimuovi_ricetta", "rifornimento", "ordine",
+        "scorta",           "producibile",     "coda",         "simula",
+        "corriere",         "altro"};
+
+// Command with its first argument, its duration in cycles and the work it did
+typedef struct flight_record {
+    int type;
+    char argument[MAX_LENGTH];
+    int32_t quantity;
+    int32_t timestamp;
+    uint64_t start;
+    uint64_t cycles;
+    uint32_t orders_scanned;
+    uint32_t lots_touched;
+} FlightRecord;
+
+// Ring buffer of the last commands, dumped when one of them turns out slow
+FlightRecord flight_recorder[FLIGHT_RECORDER_SIZE];
+uint32_t flight_recorder_count = 0;
+// Work counters of the running command
+uint32_t orders_scanned = 0;
+// a restock worker counts in its own copy, which is not recorded
+_Thread_local uint32_t lots_touched = 0;
+// Dumps are disabled while the threshold is 0
+uint64_t slow_command_cycles = 0;
+double cycles_per_microsecond = 0;
+uint64_t start_cycles = 0;
+// Prefix of the Chrome trace event files, NULL to dump as text on stderr
+char *trace_prefix = NULL;
+
+// Performance counters read around every command and summed per command type.
+// Each counter joins the group only if the kernel and the hardware provide it;
+// its slot is its position in the values read from the group, -1 if missing.
+char *profile_counter_names[PROFILE_COUNTERS] = {
+        "cycles",      "instructions",  "l1d misses",
+        "llc misses",  "branch misses", "page faults"};
+int profiling = 0;
+int profile_group = -1;
+int profile_slots[PROFILE_COUNTERS];
+uint64_t profile_start[PROFILE_COUNTERS];
+uint64_t profile_start_nanoseconds = 0;
+
+typedef struct command_profile {
+    uint64_t commands;
+    uint64_t nanoseconds;
+    uint64_t counters[PROFILE_COUNTERS];
+} CommandProfile;
+CommandProfile command_profiles[COMMAND_TYPES];
+
+// Recipe line of the catalog file, split and hashed by a preload worker. A line
+// without name is blank, one with a negative count is not a recipe. The main
+// thread resolves the ingredients of the recipes to be added, the others keep
+// them NULL, and the worker then compiles the recipe.
+typedef struct preload_recipe {
+    char *name;
+    size_t index;
+    int32_t ingredient_count;
+    char **ingredient_names;
+    size_t *ingredient_indexes;
+    int32_t *quantities;
+    Ingredient **ingredients;
+    Recipe *recipe;
+    Entry *entry;
+} PreloadRecipe;
+
+// Lines of the catalog file starting in a range of bytes, parsed and then
+// compiled by one worker thread. Its allocations are accounted by the main
+// thread after joining it.
+typedef struct preload_worker {
+    pthread_t thread;
+    char *text;
+    size_t begin;
+    size_t end;
+    PreloadRecipe *recipes;
+    uint32_t count;
+    uint32_t capacity;
+    int64_t allocated[MEMORY_SUBSYSTEMS];
+} PreloadWorker;
 
 typedef struct carrier {
     int32_t periodicity;
     int32_t capacity;
 } Carrier;
 
-int32_t current_timestamp = 0;
+// Per-process key of the hash function, so that names colliding in one run
+// cannot be precomputed
+uint64_t hash_seed[2];
+
+// Commands are read from the standard input, or from the file of the what-if
+// simulation this process is running
+FILE *input_stream = NULL;
+int is_simulation = 0;
+uint32_t running_simulations = 0;
 
+int32_t current_timestamp = 0;
+uint32_t restock_epoch = 0;
+// Timestamp of the restock whose wait queue promotion is still to be done
+int32_t pending_promotion_timestamp = -1;
+
+// Parallel restocks, off while there are no shards. Any command that reads the
+// stock waits for the restocks handed to the workers to be applied first.
+RestockShard *restock_shards = NULL;
+uint32_t restock_shard_count = 0;
+int restocks_pending = 0;
+// Net memory per subsystem of the calling worker thread, NULL on the main thread
+_Thread_local int64_t *memory_deferred = NULL;
+
+void memory_account(int, size_t, size_t);
+void memory_account_deferred(int64_t *);
+void *tracked_malloc(size_t, int);
+void *tracked_calloc(size_t, size_t, int);
+void *tracked_realloc(void *, size_t, size_t, int);
+void tracked_free(void *, size_t, int);
+void memory_reclaim();
+void memory_print_stats();
+size_t parse_size(char *);
+uint64_t read_cycles();
+void calibrate_cycles();
+int parse_command_type(char *);
+void flight_record_begin(int);
+void flight_record_argument(char *, int32_t);
+void flight_record_set_quantity(int32_t);
+void flight_record_end();
+void flight_recorder_dump(FlightRecord *);
+uint64_t read_nanoseconds();
+void profile_open();
+void profile_read(uint64_t *);
+void profile_account(int);
+void profile_print();
+void hash_seed_init();
 size_t hash(char *key);
-HashMap *hashmap_create();
-HashMapInt *hashmap_int_create();
-void hashmap_put_recipes(HashMap *map, char *key, void *value, size_t);
-void hashmap_int_put_recipes(HashMapInt *map, char *key, int value, size_t);
-void hashmap_put_ordered(HashMap *map, char *key, void *value, size_t);
+HashMap *hashmap_create(int subsystem);
+void hashmap_print_stats(HashMap *map, char *name);
+Entry *hashmap_put_recipes(HashMap *map, char *key, void *value, size_t);
 void *hashmap_get_recipe(HashMap *map, char *key, size_t);
-int hashmap_int_get_recipe(HashMapInt *map, char *key, size_t);
-void *hashmap_get_lotto(HashMap *map, char *key, int, size_t);
-Entry *hashmap_get_entries(HashMap *map, char *key, size_t);
 void hashmap_remove_recipe(HashMap *map, char *key, size_t);
-void hashmap_remove_entry(HashMap *map, char *key, Entry *entry_to_remove,
-                          size_t);
-void hashmap_free(HashMap *map);
-void hashmap_int_free(HashMapInt *map);
-Ingredient *create_ingredient(char *, int32_t);
-void add_ingredient_to_recipe(Recipe *, Ingredient *);
+void hashmap_free(HashMap *map, void (*destroy_value)(void *));
+Ingredient *get_ingredient(char *, size_t);
+void destroy_ingredient(void *);
+void ingredient_merge_lots(Ingredient *, RestockLot *, uint32_t, int32_t);
+int compare_restock_lots(const void *, const void *);
+Lotto *ingredient_remove_expired_lots(Ingredient *, int32_t);
+size_t recipe_size(int32_t);
+Recipe *compile_recipe(Ingredient **, int32_t *, int32_t);
+void destroy_recipe(void *);
+int is_known_infeasible(Recipe *, int32_t);
+void record_infeasible(Recipe *, int32_t);
+void retune_recipe(Recipe *);
 Lotto *create_lotto(int32_t, int32_t);
-Order *create_order(char *, int32_t, size_t);
-Order *create_order_timestamp(char *, int32_t, int32_t, size_t);
-void analyze_order(Order *, Recipe *);
-int evaluate_shifting_order(char *, int32_t, int32_t, size_t, Recipe *);
-void add_order_to_ready_queue(Order *);
-void add_order_to_wait_queue(Order *);
-void add_order_to_shipment_queue(Order *, Order *);
-int get_order_heaviness(Order *);
+void register_recipe(Recipe *);
+void unregister_recipe(Recipe *);
+Order create_order(Recipe *, int32_t);
+Order *order_queue_at(OrderQueue *, uint32_t);
+void order_queue_grow(OrderQueue *);
+void order_queue_push_back(OrderQueue *, Order);
+uint32_t order_queue_insert_ordered(OrderQueue *, Order);
+void order_queue_pop_front(OrderQueue *, uint32_t);
+void order_queue_remove(OrderQueue *, uint32_t);
+void order_queue_compact(OrderQueue *, int);
+void order_queue_shrink(OrderQueue *);
+int is_plausibly_feasible(Recipe *, int32_t);
+FILE *spill_create_file();
+void spill_reserve(uint32_t);
+void spill_order(Order);
+void spill_cold_orders();
+int compare_order_timestamps(const void *, const void *);
+void spill_reload(int);
+FILE *spill_copy();
+void spill_adopt(FILE *);
+void spill_close();
+int check_ingredients_availability(Recipe *, int32_t);
+void consume_ingredients(Recipe *, int32_t);
+void analyze_order(Order, Recipe *);
+void ingredient_consume(Ingredient *, int64_t);
+int join_order_batch(Recipe *, int32_t);
+int check_batched_availability(Recipe *, int32_t);
+void analyze_batched_order(Order, Recipe *);
+void flush_order_batch();
+int evaluate_shifting_order(Order *, Recipe *);
+void add_order_to_ready_queue(Order, Recipe *);
+void add_order_to_wait_queue(Order, Recipe *);
+void update_waiting_orders(Recipe *, int32_t);
+int compare_shipment_orders(const void *, const void *);
 Carrier *create_carrier(int32_t, int32_t);
-void destroy_ingredient(Ingredient *);
-void destroy_order(Order **);
 Carrier *manage_carrier();
-void manage_ingredients(Recipe *, char *);
-int seek_recipe_in_wait_list(char *);
-int seek_recipe_in_ready_list(char *);
-void print_carrier_content(int32_t);
+void parsed_ingredients_reserve(uint32_t);
+Recipe *manage_ingredients(char *);
+void preload_catalog(char *);
+int start_simulation(Carrier *, char *, char *, int32_t);
+void reap_simulations(int);
+void preload_run_workers(PreloadWorker *, uint32_t, void *(*)(void *));
+size_t preload_recipe_size(int32_t);
+void preload_parse_recipe(char *, PreloadRecipe *);
+void *preload_worker_parse(void *);
+void *preload_worker_compile(void *);
+void manage_restock(int);
+void restock_batch_append(RestockBatch *, RestockLot *, uint32_t, int32_t);
+void restock_batch_free(RestockBatch *);
+void restock_shards_start(uint32_t);
+void restock_shards_stop();
+void restock_shard_publish(RestockShard *);
+void restock_barrier();
+void *restock_worker_run(void *);
+uint32_t shipment_search(Order *);
+void shipment_insert(Order);
+void shipment_remove(Order *);
+void prepare_shipment(uint32_t);
+void reset_shipment();
+void print_carrier_content();
 void shift_orders_from_wait_to_ready_queue();
+void resolve_pending_promotion();
+int64_t ingredient_stock(Ingredient *);
+void query_stock(char *);
+void query_producible(char *);
+void query_queue(char *);
+
+char *read_word_into(char *, size_t, int *);
 
 char *read_word(int *new_line) {
     static char buffer[MAX_LENGTH];
-    int i = 0;
+    return read_word_into(buffer, MAX_LENGTH, new_line);
+}
+
+char *read_word_into(char *buffer, size_t size, int *new_line) {
+    size_t i = 0;
     int c;
 
     // Skip leading whitespace
-    while ((c = getc_unlocked(stdin)) != EOF && isspace(c) && c != '\n')
+    while ((c = getc_unlocked(input_stream)) != EOF && isspace(c) && c != '\n')
         ;
 
     if (c == EOF)
@@ -114,9 +501,10 @@ char *read_word(int *new_line) {
 
     // Read the word
     do {
-        if (i < MAX_LENGTH - 1)
+        if (i < size - 1)
             buffer[i++] = c;
-    } while ((c = getc_unlocked(stdin)) != EOF && !isspace(c) && c != '\n');
+    } while ((c = getc_unlocked(input_stream)) != EOF && !isspace(c) &&
+             c != '\n');
 
     buffer[i] = '\0';
     // If we stopped because of a newline returns 1
@@ -132,7 +520,7 @@ int read_int(int *new_line) {
     int c;
 
     // Skip leading whitespace
-    while ((c = getc_unlocked(stdin)) != EOF && isspace(c) && c != '\n')
+    while ((c = getc_unlocked(input_stream)) != EOF && isspace(c) && c != '\n')
         ;
 
     if (c == EOF)
@@ -140,7 +528,7 @@ int read_int(int *new_line) {
 
     while (c != EOF && isdigit(c) && c != '\n') {
         number = number * 10 + (c - '0');
-        c = getc_unlocked(stdin);
+        c = getc_unlocked(input_stream);
     }
     // If we stopped because of a newline returns 1
     if (c == '\n')
@@ -155,9 +543,12 @@ void print(HashMap *map) {
         Entry *entry = map->table[i];
         while (entry != NULL) {
             Entry *next = entry->next;
-            printf("%s[%d]: qty:%d, exp:%d, ", entry->key, i,
-                   ((Lotto *)entry->value)->ingredient_quantity,
-                   ((Lotto *)entry->value)->ingredient_expiration_date);
+            Lotto *lot = ((Ingredient *)entry->value)->lots;
+            while (lot != NULL) {
+                printf("%s[%d]: qty:%d, exp:%d, ", entry->key, i,
+                       lot->ingredient_quantity, lot->ingredient_expiration_date);
+                lot = lot->next;
+            }
             entry = next;
         }
         if (entry != NULL)
@@ -165,31 +556,106 @@ void print(HashMap *map) {
     }
 }
 
-void print_queue(Order *iter) {
-    while (iter != NULL) {
-        printf("%s, ts: %d, qty: %d\n", iter->recipe_name, iter->order_timestamp,
-               iter->quantity);
-
-        iter = iter->next;
+void print_queue(OrderQueue *queue) {
+    for (uint32_t i = 0; i < queue->count; i++) {
+        Order *order = order_queue_at(queue, i);
+        if (order->recipe != ORDER_TOMBSTONE)
+            printf("%s, ts: %d, qty: %d\n", recipe_table[order->recipe]->name,
+                   order->order_timestamp, order->quantity);
     }
 }
 
-int main() {
+int main(int argc, char **argv) {
     char *input, *param;
     int new_line = 0;
+    int print_stats = 0;
+    // queries take no time, so the courier may already have passed
+    int32_t last_courier_timestamp = 0;
+    long slow_command_microseconds = 0;
+    char *catalog_path = NULL;
+    long restock_workers = 0;
+    int option;
+
+    while ((option = getopt(argc, argv, "sm:d:l:T:c:bpj:")) != -1) {
+        if (option == 's')
+            print_stats = 1;
+        else if (option == 'm')
+            memory_budget = parse_size(optarg);
+        else if (option == 'd')
+            spill_directory = optarg;
+        else if (option == 'l')
+            slow_command_microseconds = atol(optarg);
+        else if (option == 'T')
+            trace_prefix = optarg;
+        else if (option == 'c')
+            catalog_path = optarg;
+        else if (option == 'b')
+            batch_orders = 1;
+        else if (option == 'p')
+            profiling = 1;
+        else if (option == 'j')
+            restock_workers = atol(optarg);
+        else {
+            fprintf(stderr,
+                    "usage: %s [-s] [-b] [-p] [-j restock_workers] "
+                    "[-m memory_budget] [-d spill_directory] "
+                    "[-l slow_microseconds] "
+                    "[-T trace_prefix] [-c catalog_file]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
 
-    catalog_tree = hashmap_create();
-    warehouse_tree = hashmap_create();
+    if (slow_command_microseconds > 0) {
+        calibrate_cycles();
+        slow_command_cycles =
+                (uint64_t)(slow_command_microseconds * cycles_per_microsecond);
+    }
+    start_cycles = read_cycles();
+    if (profiling)
+        profile_open();
+    input_stream = stdin;
+    hash_seed_init();
+
+    catalog_tree = hashmap_create(MEMORY_CATALOG);
+    warehouse_tree = hashmap_create(MEMORY_WAREHOUSE);
+    if (restock_workers > 0)
+        restock_shards_start(restock_workers < RESTOCK_MAX_SHARDS
+                                     ? restock_workers
+                                     : RESTOCK_MAX_SHARDS);
+    if (catalog_path != NULL)
+        preload_catalog(catalog_path);
 
     // reading <periodicity, capacity> of the carrier
     Carrier *carrier = manage_carrier();
+    courier_capacity = carrier->capacity;
 
     while ((input = read_word(&new_line)) != NULL) {
-        if (current_timestamp % carrier->periodicity == 0 && current_timestamp != 0)
-            print_carrier_content(carrier->capacity);
+        int type = parse_command_type(input);
+
+        if (type != COMMAND_RESTOCK)
+            restock_barrier();
+        if (type != COMMAND_ORDER && batch_ingredients_count > 0)
+            flush_order_batch();
+        if (running_simulations > 0)
+            reap_simulations(WNOHANG);
+        if (memory_pressure)
+            memory_reclaim();
+        if (current_timestamp % carrier->periodicity == 0 &&
+            current_timestamp != last_courier_timestamp) {
+            flight_record_begin(COMMAND_COURIER);
+            resolve_pending_promotion();
+            print_carrier_content();
+            flight_record_end();
+            last_courier_timestamp = current_timestamp;
+        }
 
-        if (strcmp(input, "aggiungi_ricetta") == 0) {
+        flight_record_begin(type);
+        if (type == COMMAND_OTHER)
+            flight_record_argument(input, 0);
+        if (type == COMMAND_ADD_RECIPE) {
             if ((param = read_word(&new_line)) != NULL) {
+                flight_record_argument(param, 0);
                 size_t rec_index = hash(param);
                 Recipe *rec =
                         (Recipe *)hashmap_get_recipe(catalog_tree, param, rec_index);
@@ -202,346 +668,643 @@ int main() {
                         read_int(&new_line);
                     }
                 } else {
-                    // reading recipe name, create and insert recipe into the catalog
-                    Recipe *recipe = (Recipe *)malloc(sizeof(Recipe));
-                    recipe->ingredients = NULL;
-                    hashmap_put_recipes(catalog_tree, param, recipe, rec_index);
+                    // reading recipe name, compile and insert recipe into the catalog
+                    char recipe_name[MAX_LENGTH];
+                    strcpy(recipe_name, param);
                     printf("aggiunta\n");
                     fflush(stdout);
 
-                    // reading all the ingredients pairs<ingredient_name, quantity> adding
-                    // them to the related recipe
-                    manage_ingredients(recipe, param);
+                    // reading all the ingredients pairs<ingredient_name, quantity> and
+                    // compiling them into the recipe block
+                    Recipe *recipe = manage_ingredients(param);
+                    strcpy(recipe->name, recipe_name);
+                    register_recipe(recipe);
+                    hashmap_put_recipes(catalog_tree, recipe_name, recipe, rec_index);
                 }
             }
-        } else if (strcmp(input, "rimuovi_ricetta") == 0) {
+        } else if (type == COMMAND_REMOVE_RECIPE) {
             if ((param = read_word(&new_line)) != NULL) {
+                flight_record_argument(param, 0);
                 size_t rec_index = hash(param);
                 Recipe *recipe =
                         (Recipe *)hashmap_get_recipe(catalog_tree, param, rec_index);
+                if (recipe != NULL)
+                    resolve_pending_promotion();
                 if (recipe == NULL) {
                     printf("non presente\n");
                     fflush(stdout);
-                } else if (seek_recipe_in_wait_list(param) ||
-                           seek_recipe_in_ready_list(param)) {
+                } else if (recipe->waiting_orders > 0 ||
+                           recipe->ready_orders > 0) {
                     printf("ordini in sospeso\n");
                     fflush(stdout);
                 } else {
+                    unregister_recipe(recipe);
                     hashmap_remove_recipe(catalog_tree, param, rec_index);
                     printf("rimossa\n");
                     fflush(stdout);
                 }
             }
-        } else if (strcmp(input, "rifornimento") == 0) {
-            int ingredient_quantity = 0, ingredient_expiration_date = 0;
-            while (new_line == 0 && (param = read_word(&new_line))) {
-                size_t lot_index = hash(param);
-                ingredient_quantity = read_int(&new_line);
-                ingredient_expiration_date = read_int(&new_line);
-                Lotto *lot = (Lotto *)hashmap_get_lotto(
-                        warehouse_tree, param, ingredient_expiration_date, lot_index);
-                if (lot != NULL)
-                    lot->ingredient_quantity += ingredient_quantity;
-                else {
-                    if (ingredient_expiration_date > current_timestamp) {
-                        hashmap_put_ordered(
-                                warehouse_tree, param,
-                                create_lotto(ingredient_quantity, ingredient_expiration_date),
-                                lot_index);
-                    }
-                }
-            }
-            shift_orders_from_wait_to_ready_queue();
+        } else if (type == COMMAND_RESTOCK) {
+            manage_restock(new_line);
             printf("rifornito\n");
             fflush(stdout);
-        } else if (strcmp(input, "ordine") == 0) {
+        } else if (type == COMMAND_ORDER) {
             if ((param = read_word(&new_line)) != NULL) {
                 int order_quantity = read_int(&new_line);
-                size_t rec_index = hash(param);
-                Recipe *rec = hashmap_get_recipe(catalog_tree, param, rec_index);
+                flight_record_argument(param, order_quantity);
+                Recipe *rec = batch_recipe;
+                if (rec == NULL || strcmp(rec->name, param) != 0)
+                    rec = hashmap_get_recipe(catalog_tree, param, hash(param));
                 if (rec != NULL) {
                     printf("accettato\n");
                     fflush(stdout);
-                    analyze_order(create_order(param, order_quantity, rec_index), rec);
+                    resolve_pending_promotion();
+                    if (batch_orders)
+                        analyze_batched_order(create_order(rec, order_quantity),
+                                              rec);
+                    else
+                        analyze_order(create_order(rec, order_quantity), rec);
                 } else {
                     printf("rifiutato\n");
                     fflush(stdout);
                 }
             }
+        } else if (type >= COMMAND_STOCK_QUERY && type <= COMMAND_QUEUE_QUERY) {
+            // read-only queries leave the time unchanged
+            if ((param = read_word(&new_line)) != NULL) {
+                flight_record_argument(param, 0);
+                if (type == COMMAND_STOCK_QUERY)
+                    query_stock(param);
+                else if (type == COMMAND_PRODUCIBLE_QUERY)
+                    query_producible(param);
+                else
+                    query_queue(param);
+            }
+            flight_record_end();
+            continue;
+        } else if (type == COMMAND_SIMULATE) {
+            // the simulation goes on in a child process, which starts from a
+            // copy-on-write image of this one and reads the commands file in
+            // place of the input; here it takes no time
+            char commands_path[PATH_MAX], output_path[PATH_MAX];
+            int32_t capacity = carrier->capacity;
+
+            if (read_word_into(commands_path, PATH_MAX, &new_line) != NULL &&
+                new_line == 0 &&
+                read_word_into(output_path, PATH_MAX, &new_line) != NULL) {
+                flight_record_argument(commands_path, 0);
+                if (new_line == 0)
+                    capacity = read_int(&new_line);
+                start_simulation(carrier, commands_path, output_path, capacity);
+            }
+            flight_record_end();
+            continue;
         }
+        prepare_shipment(SHIPMENT_PREPARATION_STEPS);
+        flight_record_end();
         current_timestamp++;
     }
 
-    if (current_timestamp % carrier->periodicity == 0 && current_timestamp != 0)
-        print_carrier_content(carrier->capacity);
+    if (current_timestamp % carrier->periodicity == 0 &&
+        current_timestamp != last_courier_timestamp) {
+        flight_record_begin(COMMAND_COURIER);
+        resolve_pending_promotion();
+        print_carrier_content();
+        flight_record_end();
+    }
+    restock_barrier();
+    flush_order_batch();
+
+    if (is_simulation) {
+        fflush(stdout);
+        _exit(0);
+    }
+    reap_simulations(0);
+    restock_shards_stop();
+
+    if (print_stats) {
+        hashmap_print_stats(catalog_tree, "catalog");
+        hashmap_print_stats(warehouse_tree, "warehouse");
+        memory_print_stats();
+    }
+    if (profiling)
+        profile_print();
 
-    hashmap_free(catalog_tree);
-    hashmap_free(warehouse_tree);
+    spill_close();
+    hashmap_free(catalog_tree, destroy_recipe);
+    hashmap_free(warehouse_tree, destroy_ingredient);
     free(carrier);
     carrier = NULL;
-    destroy_order(&orders_wait_queue);
-    destroy_order(&orders_ready_queue);
-    destroy_order(&shipment_queue);
+    tracked_free(orders_wait_queue.orders,
+                 orders_wait_queue.capacity * sizeof(Order), MEMORY_QUEUES);
+    tracked_free(orders_ready_queue.orders,
+                 orders_ready_queue.capacity * sizeof(Order), MEMORY_QUEUES);
+    tracked_free(recipe_table, recipe_table_capacity * sizeof(Recipe *),
+                 MEMORY_CATALOG);
+    tracked_free(free_recipe_handles, recipe_table_capacity * sizeof(uint32_t),
+                 MEMORY_CATALOG);
+    tracked_free(parsed_ingredients,
+                 parsed_ingredients_capacity * sizeof(Ingredient *),
+                 MEMORY_BUFFERS);
+    tracked_free(parsed_quantities, parsed_ingredients_capacity * sizeof(int32_t),
+                 MEMORY_BUFFERS);
+    tracked_free(parsed_lots, parsed_lots_capacity * sizeof(RestockLot),
+                 MEMORY_BUFFERS);
+    tracked_free(shipment, shipment_capacity * sizeof(Order), MEMORY_QUEUES);
+    tracked_free(batch_ingredients,
+                 batch_ingredients_capacity * sizeof(Ingredient *),
+                 MEMORY_BUFFERS);
+
+    if (print_stats && memory_total != 0)
+        fprintf(stderr, "memory still allocated at exit: %zu bytes\n",
+                memory_total);
 
     return 0;
 }
 
-size_t hash(char *key) {
-    size_t hash = 2166136261;
-    size_t prime = 16777219;
+void memory_account(int subsystem, size_t allocated, size_t released) {
+    MemoryUsage *usage = &memory_usage[subsystem];
 
-    while (*key != '\0') {
-        hash ^= (size_t)(*key);
-        hash *= prime;
-        key++;
+    if (memory_deferred != NULL) {
+        memory_deferred[subsystem] += (int64_t)allocated - (int64_t)released;
+        return;
     }
 
-    return hash % HASHMAP_CAPACITY;
+    usage->current = usage->current + allocated - released;
+    memory_total = memory_total + allocated - released;
+    if (usage->current > usage->peak)
+        usage->peak = usage->current;
+    if (memory_budget != 0 && memory_total > memory_budget &&
+        memory_total > memory_reclaim_floor)
+        memory_pressure = 1;
 }
 
-HashMap *hashmap_create() {
-    HashMap *map = malloc(sizeof(HashMap));
-    map->table = calloc(HASHMAP_CAPACITY, sizeof(Entry *));
-    return map;
+// Accounts the net memory a worker thread allocated, and resets it
+void memory_account_deferred(int64_t *deferred) {
+    for (int i = 0; i < MEMORY_SUBSYSTEMS; i++) {
+        if (deferred[i] > 0)
+            memory_account(i, deferred[i], 0);
+        else if (deferred[i] < 0)
+            memory_account(i, 0, -deferred[i]);
+        deferred[i] = 0;
+    }
 }
 
-HashMapInt *hashmap_int_create() {
-    HashMapInt *map = malloc(sizeof(HashMapInt));
-    map->table = calloc(HASHMAP_CAPACITY, sizeof(EntryInt *));
-    return map;
+void *tracked_malloc(size_t size, int subsystem) {
+    void *ptr = malloc(size);
+    if (ptr == NULL && size != 0)
+        exit(1);
+    memory_account(subsystem, size, 0);
+    return ptr;
 }
 
-// LIFO adjacent queue management
-void hashmap_put_recipes(HashMap *map, char *key, void *value, size_t index) {
-    Entry *entry = map->table[index];
-    Entry *prev = NULL;
+void *tracked_calloc(size_t count, size_t size, int subsystem) {
+    void *ptr = calloc(count, size);
+    if (ptr == NULL && count * size != 0)
+        exit(1);
+    memory_account(subsystem, count * size, 0);
+    return ptr;
+}
 
-    while (entry != NULL && strcmp(entry->key, key) <= 0) {
-        if (entry->next != NULL && strcmp(entry->key, key) == 0 &&
-            strcmp(entry->next->key, key) != 0)
-            break;
-        prev = entry;
-        entry = entry->next;
+void *tracked_realloc(void *ptr, size_t old_size, size_t size, int subsystem) {
+    ptr = realloc(ptr, size);
+    if (ptr == NULL && size != 0)
+        exit(1);
+    memory_account(subsystem, size, old_size);
+    return ptr;
+}
+
+// The size of the block is given by the caller, which always knows it
+void tracked_free(void *ptr, size_t size, int subsystem) {
+    if (ptr == NULL)
+        return;
+    free(ptr);
+    memory_account(subsystem, 0, size);
+}
+
+// Gives back everything that is not needed to answer the next commands: the
+// expired lots, the tombstones of the wait queue, the unused capacity of the
+// queues and the scratch buffers. The pending promotion is resolved first since
+// it may still rely on lots expired in the meantime.
+void memory_reclaim() {
+    memory_pressure = 0;
+    restock_barrier();
+    flush_order_batch();
+    resolve_pending_promotion();
+
+    for (int i = 0; i < HASHMAP_CAPACITY; i++)
+        for (Entry *entry = warehouse_tree->table[i]; entry != NULL;
+             entry = entry->next)
+            ingredient_remove_expired_lots((Ingredient *)entry->value,
+                                           current_timestamp);
+
+    order_queue_compact(&orders_wait_queue, 1);
+    spill_cold_orders();
+    order_queue_shrink(&orders_wait_queue);
+    order_queue_shrink(&orders_ready_queue);
+
+    tracked_free(parsed_ingredients,
+                 parsed_ingredients_capacity * sizeof(Ingredient *),
+                 MEMORY_BUFFERS);
+    tracked_free(parsed_quantities, parsed_ingredients_capacity * sizeof(int32_t),
+                 MEMORY_BUFFERS);
+    parsed_ingredients = NULL;
+    parsed_quantities = NULL;
+    parsed_ingredients_capacity = 0;
+    tracked_free(parsed_lots, parsed_lots_capacity * sizeof(RestockLot),
+                 MEMORY_BUFFERS);
+    parsed_lots = NULL;
+    parsed_lots_capacity = 0;
+    if (shipment_count == 0) {
+        tracked_free(shipment, shipment_capacity * sizeof(Order), MEMORY_QUEUES);
+        shipment = NULL;
+        shipment_capacity = 0;
     }
-    // Create new entry
-    Entry *new_entry = malloc(sizeof(Entry));
-    new_entry->key = strdup(key);
-    new_entry->value = value;
-    if (prev != NULL) {
-        prev->next = new_entry;
-    } else {
-        map->table[index] = new_entry;
+
+    // what is left is live data: wait for it to grow before trying again
+    memory_reclaim_floor = memory_total + memory_total / 8;
+}
+
+void memory_print_stats() {
+    for (int i = 0; i < MEMORY_SUBSYSTEMS; i++)
+        fprintf(stderr, "%s memory: %zu bytes, peak %zu bytes\n",
+                memory_subsystem_names[i], memory_usage[i].current,
+                memory_usage[i].peak);
+    if (spill_file != NULL)
+        fprintf(stderr, "spilled orders: %u, spill file: %zu bytes\n",
+                spill_live, spill_capacity * sizeof(Order));
+}
+
+// Byte count with an optional k, m or g suffix
+size_t parse_size(char *text) {
+    char *suffix;
+    size_t size = strtoull(text, &suffix, 10);
+
+    if (*suffix == 'k' || *suffix == 'K')
+        size <<= 10;
+    else if (*suffix == 'm' || *suffix == 'M')
+        size <<= 20;
+    else if (*suffix == 'g' || *suffix == 'G')
+        size <<= 30;
+    return size;
+}
+
+uint64_t read_cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    uint64_t cycles;
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(cycles));
+    return cycles;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
+// Measures the cycle counter against the monotonic clock over 10 ms
+void calibrate_cycles() {
+    struct timespec begin, end, pause = {0, 10000000};
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    uint64_t begin_cycles = read_cycles();
+    nanosleep(&pause, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    uint64_t end_cycles = read_cycles();
+
+    double microseconds = (end.tv_sec - begin.tv_sec) * 1e6 +
+                          (end.tv_nsec - begin.tv_nsec) / 1e3;
+    cycles_per_microsecond = (end_cycles - begin_cycles) / microseconds;
+}
+
+int parse_command_type(char *command) {
+    for (int type = 0; type < COMMAND_COURIER; type++)
+        if (strcmp(command, command_names[type]) == 0)
+            return type;
+    return COMMAND_OTHER;
+}
+
+void flight_record_begin(int type) {
+    FlightRecord *record =
+            &flight_recorder[flight_recorder_count % FLIGHT_RECORDER_SIZE];
+
+    record->type = type;
+    record->argument[0] = '\0';
+    record->quantity = 0;
+    record->timestamp = current_timestamp;
+    orders_scanned = 0;
+    lots_touched = 0;
+    if (profiling) {
+        profile_read(profile_start);
+        profile_start_nanoseconds = read_nanoseconds();
     }
-    new_entry->next = entry;
+    record->start = read_cycles();
 }
 
-// LIFO adjacent queue management
-void hashmap_int_put_recipes(HashMapInt *map, char *key, int value,
-                             size_t index) {
-    EntryInt *entry = map->table[index];
-    EntryInt *prev = NULL;
+// Longer arguments, such as the paths of a simulation, are truncated
+void flight_record_argument(char *argument, int32_t quantity) {
+    FlightRecord *record =
+            &flight_recorder[flight_recorder_count % FLIGHT_RECORDER_SIZE];
+    size_t length = strnlen(argument, sizeof(record->argument) - 1);
 
-    while (entry != NULL && strcmp(entry->key, key) <= 0) {
-        if (strcmp(entry->key, key) == 0) {
-            entry->value = value;
+    memcpy(record->argument, argument, length);
+    record->argument[length] = '\0';
+    record->quantity = quantity;
+}
+
+// For commands whose quantity is only known once they are done
+void flight_record_set_quantity(int32_t quantity) {
+    flight_recorder[flight_recorder_count % FLIGHT_RECORDER_SIZE].quantity =
+            quantity;
+}
+
+void flight_record_end() {
+    FlightRecord *record =
+            &flight_recorder[flight_recorder_count % FLIGHT_RECORDER_SIZE];
+
+    record->cycles = read_cycles() - record->start;
+    if (profiling)
+        profile_account(record->type);
+    record->orders_scanned = orders_scanned;
+    record->lots_touched = lots_touched;
+    flight_recorder_count++;
+    if (slow_command_cycles != 0 && record->cycles >= slow_command_cycles)
+        flight_recorder_dump(record);
+}
+
+// Writes the recorded commands, oldest first, either as text on stderr or as a
+// Chrome trace event file named after the timestamp of the slow command and its
+// sequence number, since queries share the timestamp of the next command
+void flight_recorder_dump(FlightRecord *slow) {
+    uint32_t count = flight_recorder_count < FLIGHT_RECORDER_SIZE
+                             ? flight_recorder_count
+                             : FLIGHT_RECORDER_SIZE;
+    FILE *output = stderr;
+
+    if (trace_prefix != NULL) {
+        char path[4096];
+        snprintf(path, sizeof(path), "%s-%d-%u-%s.json", trace_prefix,
+                 slow->timestamp, flight_recorder_count - 1,
+                 command_names[slow->type]);
+        if ((output = fopen(path, "w")) == NULL)
             return;
+        fprintf(output, "{\"traceEvents\":[");
+    } else
+        fprintf(stderr, "slow %s at timestamp %d: %llu cycles\n",
+                command_names[slow->type], slow->timestamp,
+                (unsigned long long)slow->cycles);
+
+    for (uint32_t i = 0; i < count; i++) {
+        FlightRecord *record =
+                &flight_recorder[(flight_recorder_count - count + i) %
+                                 FLIGHT_RECORDER_SIZE];
+        if (trace_prefix == NULL) {
+            fprintf(output, "  %d %s %s %d: %llu cycles, %u orders, %u lots\n",
+                    record->timestamp, command_names[record->type],
+                    record->argument, record->quantity,
+                    (unsigned long long)record->cycles, record->orders_scanned,
+                    record->lots_touched);
+            continue;
         }
-        prev = entry;
-        entry = entry->next;
+        fprintf(output, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":1,"
+                        "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"timestamp\":%d,"
+                        "\"argument\":\"",
+                i == 0 ? "" : ",\n", command_names[record->type],
+                (record->start - start_cycles) / cycles_per_microsecond,
+                record->cycles / cycles_per_microsecond, record->timestamp);
+        for (char *c = record->argument; *c != '\0'; c++)
+            if (*c == '"' || *c == '\\')
+                fprintf(output, "\\%c", *c);
+            else if ((unsigned char)*c >= ' ')
+                fputc(*c, output);
+        fprintf(output, "\",\"quantity\":%d,\"orders_scanned\":%u,"
+                        "\"lots_touched\":%u}}",
+                record->quantity, record->orders_scanned, record->lots_touched);
     }
-    // Create new entry
-    EntryInt *new_entry = malloc(sizeof(EntryInt));
-    new_entry->key = strdup(key);
-    new_entry->value = value;
-    if (prev != NULL) {
-        prev->next = new_entry;
-    } else {
-        map->table[index] = new_entry;
+
+    if (trace_prefix != NULL) {
+        fprintf(output, "]}\n");
+        fclose(output);
     }
-    new_entry->next = entry;
 }
 
-// Alphabetical and Expiration data ordered adjacent queue management
-void hashmap_put_ordered(HashMap *map, char *key, void *value, size_t index) {
-    Entry *entry = map->table[index];
-    Entry *prev = NULL;
-
-    while (entry != NULL && strcmp(entry->key, key) <= 0) {
-        if (current_timestamp >=
-            ((Lotto *)entry->value)->ingredient_expiration_date) {
-            // Expired lotto
-            Entry *next = entry->next;
+uint64_t read_nanoseconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
 
-            if (prev == NULL) {
-                map->table[index] = next;
-                prev = NULL;
-            } else {
-                prev->next = next;
-            }
-            free(entry->key);
-            free(entry);
-            entry = next;
-        } else {
-            if (entry->next != NULL) {
-                if (strcmp(entry->key, key) < 0) {
-                    prev = entry;
-                    entry = entry->next;
-                } else if (strcmp(entry->key, key) == 0) {
-                    if (strcmp(entry->next->key, key) != 0) {
-                        if (((Lotto *)entry->value)->ingredient_expiration_date >=
-                            ((Lotto *)value)->ingredient_expiration_date)
-                            break;
-                        else {
-                            prev = entry;
-                            entry = entry->next;
-                            break;
-                        }
-                    } else { // strcmp(entry->next->key, key) == 0
-                        if (((Lotto *)entry->value)->ingredient_expiration_date <
-                            ((Lotto *)value)->ingredient_expiration_date) {
-                            prev = entry;
-                            entry = entry->next;
-                        } else
-                            break;
-                    }
-                } else { // strcmp(entry->key, key) > 0
-                    exit(1);
-                }
-            }
-            if (entry->next == NULL) {
-                if (strcmp(entry->key, key) > 0) {
-                    break;
-                } else if (strcmp(entry->key, key) == 0) {
-                    if (((Lotto *)entry->value)->ingredient_expiration_date >=
-                        ((Lotto *)value)->ingredient_expiration_date) {
-                        break;
-                    } else {
-                        prev = entry;
-                        entry = entry->next;
-                        break;
-                    }
-                } else {
-                    prev = entry;
-                    entry = entry->next;
-                    break;
-                }
-            }
-        }
+// Opens the counters of this thread, the hardware ones in user space only so
+// that no privilege is needed. Missing counters are reported and skipped:
+// without any, only the time and the throughput are profiled.
+void profile_open() {
+    int slot = 0;
+
+    for (int i = 0; i < PROFILE_COUNTERS; i++)
+        profile_slots[i] = -1;
+#ifdef __linux__
+    struct {
+        uint32_t type;
+        uint64_t config;
+    } events[PROFILE_COUNTERS] = {
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+            {PERF_TYPE_HW_CACHE,
+             PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                     (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+            {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS}};
+
+    for (int i = 0; i < PROFILE_COUNTERS; i++) {
+        struct perf_event_attr attr;
+
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[i].type;
+        attr.config = events[i].config;
+        attr.read_format = PERF_FORMAT_GROUP;
+        attr.disabled = profile_group == -1;
+        attr.exclude_kernel = events[i].type != PERF_TYPE_SOFTWARE;
+        attr.exclude_hv = 1;
+        int fd = syscall(SYS_perf_event_open, &attr, 0, -1, profile_group, 0);
+        if (fd < 0)
+            continue;
+        if (profile_group == -1)
+            profile_group = fd;
+        profile_slots[i] = slot++;
     }
-    // Create new entry
-    Entry *new_entry = malloc(sizeof(Entry));
-    new_entry->key = strdup(key);
-    new_entry->value = value;
-    if (prev != NULL) {
-        prev->next = new_entry;
-    } else {
-        map->table[index] = new_entry;
+    if (profile_group != -1) {
+        ioctl(profile_group, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(profile_group, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
     }
-    new_entry->next = entry;
+#endif
+    for (int i = 0; i < PROFILE_COUNTERS; i++)
+        if (profile_slots[i] == -1)
+            fprintf(stderr, "profile: %s counter not available\n",
+                    profile_counter_names[i]);
 }
 
-void *hashmap_get_recipe(HashMap *map, char *key, size_t index) {
-    Entry *entry = map->table[index];
-    while (entry != NULL) {
-        if (strcmp(entry->key, key) == 0) {
-            return entry->value;
-        }
-        if (strcmp(entry->key, key) < 0) {
-            entry = entry->next;
-        } else
-            break;
-    }
-    return NULL; // Key not found
+// Reads the counters, leaving the missing ones at 0
+void profile_read(uint64_t *values) {
+    uint64_t group[PROFILE_COUNTERS + 1];
+
+    memset(values, 0, PROFILE_COUNTERS * sizeof(uint64_t));
+    if (profile_group != -1 &&
+        read(profile_group, group, sizeof(group)) > (ssize_t)sizeof(uint64_t))
+        for (int i = 0; i < PROFILE_COUNTERS; i++)
+            if (profile_slots[i] != -1 && (uint64_t)profile_slots[i] < group[0])
+                values[i] = group[1 + profile_slots[i]];
 }
 
-int hashmap_int_get_recipe(HashMapInt *map, char *key, size_t index) {
-    EntryInt *entry = map->table[index];
-    while (entry != NULL) {
-        if (strcmp(entry->key, key) == 0) {
-            return entry->value;
-        }
-        if (strcmp(entry->key, key) < 0) {
-            entry = entry->next;
-        } else
-            break;
+void profile_account(int type) {
+    uint64_t nanoseconds = read_nanoseconds();
+    uint64_t values[PROFILE_COUNTERS];
+    CommandProfile *profile = &command_profiles[type];
+
+    profile_read(values);
+    profile->commands++;
+    profile->nanoseconds += nanoseconds - profile_start_nanoseconds;
+    for (int i = 0; i < PROFILE_COUNTERS; i++)
+        profile->counters[i] += values[i] - profile_start[i];
+}
+
+// Per command type: count, time, throughput and the average of each counter
+void profile_print() {
+    uint64_t commands = 0, nanoseconds = 0;
+
+    fprintf(stderr, "%-16s %9s %9s %11s", "command", "count", "seconds",
+            "per second");
+    for (int i = 0; i < PROFILE_COUNTERS; i++)
+        if (profile_slots[i] != -1)
+            fprintf(stderr, " %13s", profile_counter_names[i]);
+    fprintf(stderr, "\n");
+
+    for (int type = 0; type < COMMAND_TYPES; type++) {
+        CommandProfile *profile = &command_profiles[type];
+        if (profile->commands == 0)
+            continue;
+        commands += profile->commands;
+        nanoseconds += profile->nanoseconds;
+
+        double seconds = profile->nanoseconds / 1e9;
+        fprintf(stderr, "%-16s %9llu %9.3f %11.0f", command_names[type],
+                (unsigned long long)profile->commands, seconds,
+                seconds > 0 ? profile->commands / seconds : 0);
+        for (int i = 0; i < PROFILE_COUNTERS; i++)
+            if (profile_slots[i] != -1)
+                fprintf(stderr, " %13.3f",
+                        (double)profile->counters[i] / profile->commands);
+        fprintf(stderr, "\n");
     }
-    return -1; // Key not found
+    fprintf(stderr, "%-16s %9llu %9.3f %11.0f\n", "total",
+            (unsigned long long)commands, nanoseconds / 1e9,
+            nanoseconds > 0 ? commands / (nanoseconds / 1e9) : 0);
 }
 
-void *hashmap_get_lotto(HashMap *map, char *key, int expiration_date,
-                        size_t index) {
-    Entry *prev = NULL;
-    Entry *entry = map->table[index];
+void hash_seed_init() {
+    FILE *random = fopen("/dev/urandom", "rb");
 
-    while (entry != NULL) {
-        if (current_timestamp >=
-            ((Lotto *)entry->value)->ingredient_expiration_date) {
-            // Expired lotto
-            Entry *next = entry->next;
-            if (prev == NULL) {
-                map->table[index] = next;
-                prev = NULL;
-            } else {
-                prev->next = next;
-            }
+    if (random == NULL || fread(hash_seed, sizeof(hash_seed), 1, random) != 1) {
+        hash_seed[0] = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32);
+        hash_seed[1] = (uint64_t)(uintptr_t)&hash_seed ^ (uint64_t)clock();
+    }
+    if (random != NULL)
+        fclose(random);
+}
 
-            free(entry->key);
-            free(entry);
+// SipHash-1-3 keyed with the per-process seed
+size_t hash(char *key) {
+    uint64_t v0 = 0x736f6d6570736575ULL ^ hash_seed[0];
+    uint64_t v1 = 0x646f72616e646f6dULL ^ hash_seed[1];
+    uint64_t v2 = 0x6c7967656e657261ULL ^ hash_seed[0];
+    uint64_t v3 = 0x7465646279746573ULL ^ hash_seed[1];
+    size_t length = strlen(key);
+    uint64_t last = (uint64_t)length << 56;
+    uint64_t m;
+
+    for (; length >= 8; length -= 8, key += 8) {
+        memcpy(&m, key, sizeof(m));
+        v3 ^= m;
+        SIPROUND;
+        v0 ^= m;
+    }
+    for (size_t i = 0; i < length; i++)
+        last |= (uint64_t)(unsigned char)key[i] << (8 * i);
+
+    v3 ^= last;
+    SIPROUND;
+    v0 ^= last;
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+
+    return (v0 ^ v1 ^ v2 ^ v3) % HASHMAP_CAPACITY;
+}
 
-            entry = next;
-        } else {
-            if (strcmp(entry->key, key) == 0 &&
-                ((Lotto *)entry->value)->ingredient_expiration_date ==
-                expiration_date) {
-                return entry->value;
-            }
+HashMap *hashmap_create(int subsystem) {
+    HashMap *map = tracked_malloc(sizeof(HashMap), subsystem);
+    map->table = tracked_calloc(HASHMAP_CAPACITY, sizeof(Entry *), subsystem);
+    map->subsystem = subsystem;
+    return map;
+}
 
-            prev = entry;
-            entry = entry->next;
-        }
+// Reports on stderr the number of entries and the longest bucket chain, which
+// bounds the cost of a lookup
+void hashmap_print_stats(HashMap *map, char *name) {
+    size_t entries = 0, longest_chain = 0;
+
+    for (int i = 0; i < HASHMAP_CAPACITY; i++) {
+        size_t chain = 0;
+        for (Entry *entry = map->table[i]; entry != NULL; entry = entry->next)
+            chain++;
+        entries += chain;
+        if (chain > longest_chain)
+            longest_chain = chain;
     }
-    return NULL; // Key not found
+    fprintf(stderr, "%s: %zu entries, longest chain %zu\n", name, entries,
+            longest_chain);
 }
 
-Entry *hashmap_get_entries(HashMap *map, char *key, size_t index) {
+// LIFO adjacent queue management
+// Returns the new entry, whose value can be replaced later
+Entry *hashmap_put_recipes(HashMap *map, char *key, void *value, size_t index) {
     Entry *entry = map->table[index];
+    Entry *prev = NULL;
 
-    while (entry != NULL) {
-        if (strcmp(entry->key, key) == 0) {
-            return entry;
-        }
+    while (entry != NULL && strcmp(entry->key, key) <= 0) {
+        if (entry->next != NULL && strcmp(entry->key, key) == 0 &&
+            strcmp(entry->next->key, key) != 0)
+            break;
+        prev = entry;
         entry = entry->next;
     }
-    return NULL; // Key not found
+    // Create new entry
+    Entry *new_entry = tracked_malloc(sizeof(Entry), map->subsystem);
+    new_entry->key = tracked_malloc(strlen(key) + 1, map->subsystem);
+    strcpy(new_entry->key, key);
+    new_entry->value = value;
+    if (prev != NULL) {
+        prev->next = new_entry;
+    } else {
+        map->table[index] = new_entry;
+    }
+    new_entry->next = entry;
+    return new_entry;
 }
 
-Entry *hashmap_get_and_remove_expired_entries(HashMap *map, char *key,
-                                              size_t index) {
+void *hashmap_get_recipe(HashMap *map, char *key, size_t index) {
     Entry *entry = map->table[index];
-    Entry *prev = NULL;
-
     while (entry != NULL) {
-        if (current_timestamp >=
-            ((Lotto *)entry->value)->ingredient_expiration_date) {
-            // Expired lotto
-            Entry *next = entry->next;
-            if (prev == NULL) {
-                map->table[index] = next;
-                prev = NULL;
-            } else {
-                prev->next = next;
-            }
-
-            free(entry->key);
-            free(entry);
-            entry = next;
-        } else {
-            if (strcmp(entry->key, key) == 0) {
-                return entry;
-            }
-            prev = entry;
-            entry = entry->next;
+        if (strcmp(entry->key, key) == 0) {
+            return entry->value;
         }
+        if (strcmp(entry->key, key) < 0) {
+            entry = entry->next;
+        } else
+            break;
     }
     return NULL; // Key not found
 }
@@ -557,9 +1320,9 @@ void hashmap_remove_recipe(HashMap *map, char *key, size_t index) {
             } else {
                 prev->next = entry->next;
             }
-            free(entry->key);
-            destroy_ingredient(((Recipe *)entry->value)->ingredients);
-            free(entry);
+            tracked_free(entry->key, strlen(entry->key) + 1, map->subsystem);
+            destroy_recipe(entry->value);
+            tracked_free(entry, sizeof(Entry), map->subsystem);
             return;
         }
         prev = entry;
@@ -567,348 +1330,817 @@ void hashmap_remove_recipe(HashMap *map, char *key, size_t index) {
     }
 }
 
-void hashmap_remove_entry(HashMap *map, char *key, Entry *entry_to_remove,
-                          size_t index) {
-    Entry *prev = NULL;
-    Entry *entry = map->table[index];
-
-    while (entry->next != NULL && entry != entry_to_remove) {
-        prev = entry;
-        entry = entry->next;
-    }
-
-    if (prev == NULL) {
-        map->table[index] = entry->next;
-    } else {
-        prev->next = entry->next;
-    }
-    free(entry->key);
-    free(entry);
-}
-
-void hashmap_free(HashMap *map) {
+void hashmap_free(HashMap *map, void (*destroy_value)(void *)) {
     for (int i = 0; i < HASHMAP_CAPACITY; i++) {
         Entry *entry = map->table[i];
         while (entry != NULL) {
             Entry *next = entry->next;
-            free(entry->key);
-            free(entry);
+            destroy_value(entry->value);
+            tracked_free(entry->key, strlen(entry->key) + 1, map->subsystem);
+            tracked_free(entry, sizeof(Entry), map->subsystem);
             entry = next;
         }
     }
-    free(map->table);
-    free(map);
+    tracked_free(map->table, HASHMAP_CAPACITY * sizeof(Entry *), map->subsystem);
+    tracked_free(map, sizeof(HashMap), map->subsystem);
 }
 
-void hashmap_int_free(HashMapInt *map) {
-    for (int i = 0; i < HASHMAP_CAPACITY; i++) {
-        EntryInt *entry = map->table[i];
-        while (entry != NULL) {
-            EntryInt *next = entry->next;
-            free(entry->key);
-            free(entry);
-            entry = next;
+// Returns the warehouse record of the ingredient, creating it on first use
+Ingredient *get_ingredient(char *name, size_t ing_index) {
+    Ingredient *ing = hashmap_get_recipe(warehouse_tree, name, ing_index);
+    if (ing == NULL) {
+        ing = (Ingredient *)tracked_malloc(sizeof(Ingredient), MEMORY_WAREHOUSE);
+        ing->lots = NULL;
+        ing->stock = 0;
+        ing->version = 0;
+        ing->waiting_orders = 0;
+        ing->probes = 0;
+        ing->failures = 0;
+        ing->batch_consumption = 0;
+        ing->batch_horizon = -1;
+        ing->shard = restock_shard_count > 0 ? ing_index % restock_shard_count : 0;
+        hashmap_put_recipes(warehouse_tree, name, ing, ing_index);
+    }
+    return ing;
+}
+
+void destroy_ingredient(void *value) {
+    Ingredient *ingredient = (Ingredient *)value;
+
+    while (ingredient->lots != NULL) {
+        Lotto *next = ingredient->lots->next;
+        tracked_free(ingredient->lots, sizeof(Lotto), MEMORY_WAREHOUSE);
+        ingredient->lots = next;
+    }
+    tracked_free(ingredient, sizeof(Ingredient), MEMORY_WAREHOUSE);
+}
+
+// Lots are kept ordered by expiration date, so the expired ones are always at
+// the head of the list. The time is given since the restock workers merge lots
+// as of the restock they are applying.
+Lotto *ingredient_remove_expired_lots(Ingredient *ingredient, int32_t timestamp) {
+    while (ingredient->lots != NULL &&
+           timestamp >= ingredient->lots->ingredient_expiration_date) {
+        Lotto *next = ingredient->lots->next;
+        ingredient->stock -= ingredient->lots->ingredient_quantity;
+        tracked_free(ingredient->lots, sizeof(Lotto), MEMORY_WAREHOUSE);
+        ingredient->lots = next;
+        lots_touched++;
+    }
+    return ingredient->lots;
+}
+
+// Merges restocked lots, already ordered by expiration date, into the lots of
+// the ingredient in a single pass. Lots with the same expiration are merged and
+// the already expired ones, as of the time of the restock, are discarded. The
+// restock epoch is up to the caller.
+void ingredient_merge_lots(Ingredient *ingredient, RestockLot *restock,
+                           uint32_t count, int32_t timestamp) {
+    Lotto *lot = ingredient_remove_expired_lots(ingredient, timestamp);
+    Lotto *prev = NULL;
+
+    for (uint32_t i = 0; i < count; i++) {
+        int32_t expiration_date = restock[i].expiration_date;
+
+        while (lot != NULL && lot->ingredient_expiration_date < expiration_date) {
+            prev = lot;
+            lot = lot->next;
+            lots_touched++;
+        }
+        lots_touched++;
+        if (lot != NULL && lot->ingredient_expiration_date == expiration_date) {
+            lot->ingredient_quantity += restock[i].quantity;
+            ingredient->stock += restock[i].quantity;
+        } else if (expiration_date > timestamp) {
+            Lotto *new_lot = create_lotto(restock[i].quantity, expiration_date);
+            if (prev != NULL)
+                prev->next = new_lot;
+            else
+                ingredient->lots = new_lot;
+            new_lot->next = lot;
+            lot = new_lot;
+            ingredient->stock += restock[i].quantity;
         }
     }
-    free(map->table);
-    free(map);
 }
 
-Ingredient *create_ingredient(char *name, int32_t quantity) {
-    Ingredient *ing = (Ingredient *)malloc(sizeof(Ingredient));
-    ing->name = malloc(MAX_LENGTH * sizeof(char));
-    strcpy(ing->name, name);
-    ing->ing_index = hash(name);
-    ing->quantity = quantity;
-    ing->next = NULL;
-    return ing;
+// Groups the lots of a restock by ingredient, each group ordered by expiration
+int compare_restock_lots(const void *first, const void *second) {
+    const RestockLot *a = first, *b = second;
+
+    if (a->ingredient != b->ingredient)
+        return (uintptr_t)a->ingredient < (uintptr_t)b->ingredient ? -1 : 1;
+    return (a->expiration_date > b->expiration_date) -
+           (a->expiration_date < b->expiration_date);
 }
 
-// adding ingredient in a LIFO queue
-void add_ingredient_to_recipe(Recipe *recipe, Ingredient *ingredient) {
-    if (recipe->ingredients == NULL)
-        recipe->ingredients = ingredient;
-    else {
-        ingredient->next = recipe->ingredients;
-        recipe->ingredients = ingredient;
+size_t recipe_size(int32_t ingredient_count) {
+    return sizeof(Recipe) +
+           ingredient_count * (sizeof(Ingredient *) + sizeof(int32_t));
+}
+
+// Packs the ingredients of a recipe into one contiguous block, merging the
+// repeated ones and precomputing the weight of a single unit. The given arrays
+// are merged in place, so that the block is allocated with its exact size.
+Recipe *compile_recipe(Ingredient **ingredients, int32_t *quantities,
+                       int32_t count) {
+    int32_t ingredient_count = 0;
+    int32_t weight = 0;
+
+    for (int32_t i = 0; i < count; i++) {
+        int32_t quantity = quantities[i];
+        int32_t j = 0;
+        while (j < ingredient_count && ingredients[j] != ingredients[i])
+            j++;
+        if (j == ingredient_count) {
+            ingredients[j] = ingredients[i];
+            quantities[j] = 0;
+            ingredient_count++;
+        }
+        quantities[j] += quantity;
+        weight += quantity;
     }
+
+    Recipe *recipe =
+            (Recipe *)tracked_malloc(recipe_size(ingredient_count), MEMORY_CATALOG);
+    recipe->ingredients = (Ingredient **)(recipe + 1);
+    recipe->quantities = (int32_t *)(recipe->ingredients + ingredient_count);
+    recipe->ingredient_count = ingredient_count;
+    recipe->weight = weight;
+    recipe->waiting_orders = 0;
+    recipe->ready_orders = 0;
+    recipe->evaluations = 0;
+    recipe->failed_quantity = -1;
+    recipe->failed_epoch = 0;
+    recipe->spilled_orders = 0;
+    recipe->spilled_quantity = 0;
+    recipe->spill_slot = SPILL_NONE;
+    memcpy(recipe->ingredients, ingredients,
+           ingredient_count * sizeof(Ingredient *));
+    memcpy(recipe->quantities, quantities, ingredient_count * sizeof(int32_t));
+    return recipe;
+}
+
+void destroy_recipe(void *value) {
+    Recipe *recipe = (Recipe *)value;
+    tracked_free(recipe, recipe_size(recipe->ingredient_count), MEMORY_CATALOG);
 }
 
 Lotto *create_lotto(int32_t ingredient_quantity,
                     int32_t ingredient_expiration_date) {
-    Lotto *lot = (Lotto *)malloc(sizeof(Lotto));
+    Lotto *lot = (Lotto *)tracked_malloc(sizeof(Lotto), MEMORY_WAREHOUSE);
     lot->ingredient_quantity = ingredient_quantity;
     lot->ingredient_expiration_date = ingredient_expiration_date;
+    lot->next = NULL;
     return lot;
 }
 
-Order *create_order(char *recipe_name, int32_t quantity, size_t rec_index) {
-    Order *ord = (Order *)malloc(sizeof(Order));
-    ord->recipe_name = (char *)malloc(MAX_LENGTH * sizeof(char));
-    strcpy(ord->recipe_name, recipe_name);
-    ord->rec_index = rec_index;
-    ord->quantity = quantity;
-    ord->order_timestamp = current_timestamp;
-    ord->next = NULL;
-    return ord;
+void register_recipe(Recipe *recipe) {
+    if (free_recipe_handles_count > 0) {
+        recipe->handle = free_recipe_handles[--free_recipe_handles_count];
+    } else {
+        if (recipe_table_size == recipe_table_capacity) {
+            uint32_t capacity =
+                    recipe_table_capacity == 0 ? 64 : recipe_table_capacity * 2;
+            recipe_table = tracked_realloc(
+                    recipe_table, recipe_table_capacity * sizeof(Recipe *),
+                    capacity * sizeof(Recipe *), MEMORY_CATALOG);
+            free_recipe_handles = tracked_realloc(
+                    free_recipe_handles, recipe_table_capacity * sizeof(uint32_t),
+                    capacity * sizeof(uint32_t), MEMORY_CATALOG);
+            recipe_table_capacity = capacity;
+        }
+        recipe->handle = recipe_table_size++;
+    }
+    recipe_table[recipe->handle] = recipe;
 }
 
-Order *create_order_timestamp(char *recipe_name, int32_t quantity,
-                              int32_t timestamp, size_t rec_index) {
-    Order *ord = (Order *)malloc(sizeof(Order));
-    ord->recipe_name = (char *)malloc(MAX_LENGTH * sizeof(char));
-    strcpy(ord->recipe_name, recipe_name);
-    ord->rec_index = rec_index;
-    ord->quantity = quantity;
-    ord->order_timestamp = timestamp;
-    ord->next = NULL;
-    return ord;
+// A recipe can only be removed without pending orders, so its handle is free
+// to be reused
+void unregister_recipe(Recipe *recipe) {
+    recipe_table[recipe->handle] = NULL;
+    free_recipe_handles[free_recipe_handles_count++] = recipe->handle;
 }
 
-void analyze_order(Order *order, Recipe *recipe) {
-    int is_ready = 1;
-    Ingredient *ingredient = recipe->ingredients;
+Order create_order(Recipe *recipe, int32_t quantity) {
+    Order order;
+    order.recipe = recipe->handle;
+    order.quantity = quantity;
+    order.order_timestamp = current_timestamp;
+    order.weight = quantity * recipe->weight;
+    return order;
+}
 
-    if (ingredient == NULL)
-        exit(1);
+Order *order_queue_at(OrderQueue *queue, uint32_t position) {
+    return &queue->orders[(queue->head + position) & (queue->capacity - 1)];
+}
 
-    while (ingredient != NULL && is_ready) { // check availability and decide if
-        // order is ready or in wait state
-        int32_t ingredient_total_quantity = ingredient->quantity * order->quantity;
-        Entry *entries = hashmap_get_and_remove_expired_entries(
-                warehouse_tree, ingredient->name, ingredient->ing_index);
+void order_queue_grow(OrderQueue *queue) {
+    uint32_t capacity = queue->capacity == 0 ? ORDER_QUEUE_INITIAL_CAPACITY
+                                             : queue->capacity * 2;
+    Order *orders = tracked_malloc(capacity * sizeof(Order), MEMORY_QUEUES);
+
+    for (uint32_t i = 0; i < queue->count; i++)
+        orders[i] = *order_queue_at(queue, i);
+    tracked_free(queue->orders, queue->capacity * sizeof(Order), MEMORY_QUEUES);
+    queue->orders = orders;
+    queue->capacity = capacity;
+    queue->head = 0;
+}
 
-        if (entries == NULL) {
-            is_ready = 0;
-            add_order_to_wait_queue(order);
-        } else {
-            while (entries != NULL) { //&& strcmp(entries->key, ingredient->name)<=0
-                if (strcmp(entries->key, ingredient->name) == 0) {
-                    if (((Lotto *)entries->value)->ingredient_quantity >=
-                        ingredient_total_quantity) {
-                        ingredient_total_quantity = 0;
-                        break;
-                    } else
-                        ingredient_total_quantity -=
-                                ((Lotto *)entries->value)->ingredient_quantity;
-                }
-                entries = entries->next;
-            }
-            if (ingredient_total_quantity > 0) {
-                is_ready = 0;
-                add_order_to_wait_queue(order);
-            }
-            ingredient = ingredient->next;
+void order_queue_push_back(OrderQueue *queue, Order order) {
+    if (queue->count == queue->capacity)
+        order_queue_grow(queue);
+    *order_queue_at(queue, queue->count++) = order;
+    queue->live++;
+}
+
+// adding orders in a timestamp-ordered queue, walking back from the tail where
+// the most recent ones are
+// Returns the position the order was inserted at
+uint32_t order_queue_insert_ordered(OrderQueue *queue, Order order) {
+    if (queue->count == queue->capacity)
+        order_queue_grow(queue);
+
+    uint32_t position = queue->count++;
+    while (position > 0 && order_queue_at(queue, position - 1)->order_timestamp >
+                                   order.order_timestamp) {
+        *order_queue_at(queue, position) = *order_queue_at(queue, position - 1);
+        position--;
+    }
+    *order_queue_at(queue, position) = order;
+    queue->live++;
+    return position;
+}
+
+// Only for queues without tombstones
+void order_queue_pop_front(OrderQueue *queue, uint32_t count) {
+    queue->head = (queue->head + count) & (queue->capacity - 1);
+    queue->count -= count;
+    queue->live -= count;
+}
+
+void order_queue_remove(OrderQueue *queue, uint32_t position) {
+    order_queue_at(queue, position)->recipe = ORDER_TOMBSTONE;
+    queue->live--;
+}
+
+// Drops the leading tombstones for free, the others only once they outnumber
+// the live orders, unless forced
+void order_queue_compact(OrderQueue *queue, int force) {
+    uint32_t kept = 0;
+
+    while (queue->count > 0 &&
+           order_queue_at(queue, 0)->recipe == ORDER_TOMBSTONE) {
+        queue->head = (queue->head + 1) & (queue->capacity - 1);
+        queue->count--;
+    }
+    if (!force && queue->count - queue->live <= queue->live)
+        return;
+
+    for (uint32_t i = 0; i < queue->count; i++) {
+        Order *order = order_queue_at(queue, i);
+        if (order->recipe != ORDER_TOMBSTONE)
+            *order_queue_at(queue, kept++) = *order;
+    }
+    queue->count = kept;
+}
+
+// Moves the orders to the smallest buffer that holds them
+void order_queue_shrink(OrderQueue *queue) {
+    uint32_t capacity = ORDER_QUEUE_INITIAL_CAPACITY;
+
+    while (capacity < queue->count)
+        capacity *= 2;
+    if (capacity >= queue->capacity)
+        return;
+
+    Order *orders = tracked_malloc(capacity * sizeof(Order), MEMORY_QUEUES);
+    for (uint32_t i = 0; i < queue->count; i++)
+        orders[i] = *order_queue_at(queue, i);
+    tracked_free(queue->orders, queue->capacity * sizeof(Order), MEMORY_QUEUES);
+    queue->orders = orders;
+    queue->capacity = capacity;
+    queue->head = 0;
+}
+
+// False only if some ingredient is short of the quantity even counting its
+// expired lots: then the order fails as long as no restock comes
+int is_plausibly_feasible(Recipe *recipe, int32_t order_qty) {
+    for (int32_t i = 0; i < recipe->ingredient_count; i++)
+        if (recipe->ingredients[i]->stock <
+            (int64_t)recipe->quantities[i] * order_qty)
+            return 0;
+    return 1;
+}
+
+// Creates an unlinked spill file in the spill directory: tmpfile would ignore
+// TMPDIR and always put it in /tmp
+FILE *spill_create_file() {
+    char *directory = spill_directory;
+    if (directory == NULL && (directory = getenv("TMPDIR")) == NULL)
+        directory = "/tmp";
+
+    char path[PATH_MAX];
+    int fd = -1;
+    if (snprintf(path, sizeof(path), "%s/pastry_shop-spill-XXXXXX",
+                 directory) < (int)sizeof(path))
+        fd = mkstemp(path);
+    if (fd < 0) {
+        fprintf(stderr, "cannot create a spill file in %s\n", directory);
+        exit(1);
+    }
+    unlink(path);
+
+    FILE *file = fdopen(fd, "w+");
+    if (file == NULL)
+        exit(1);
+    return file;
+}
+
+// Grows the spill file, creating it on first use, to hold count more orders
+void spill_reserve(uint32_t count) {
+    if (spill_count + count <= spill_capacity)
+        return;
+
+    uint32_t capacity =
+            spill_capacity == 0 ? SPILL_INITIAL_CAPACITY : spill_capacity;
+    while (capacity < spill_count + count)
+        capacity *= 2;
+    if (spill_file == NULL)
+        spill_file = spill_create_file();
+    if (spill_orders != NULL)
+        munmap(spill_orders, spill_capacity * sizeof(Order));
+    if (ftruncate(fileno(spill_file), capacity * sizeof(Order)) != 0)
+        exit(1);
+    spill_orders = mmap(NULL, capacity * sizeof(Order), PROT_READ | PROT_WRITE,
+                        MAP_SHARED, fileno(spill_file), 0);
+    if (spill_orders == MAP_FAILED)
+        exit(1);
+    spill_capacity = capacity;
+}
+
+void spill_order(Order order) {
+    Recipe *recipe = recipe_table[order.recipe];
+
+    spill_orders[spill_count++] = order;
+    spill_live++;
+    if (recipe->spill_slot == SPILL_NONE) {
+        if (spill_recipes_count == spill_recipes_capacity) {
+            uint32_t capacity = spill_recipes_capacity == 0
+                                        ? 16
+                                        : spill_recipes_capacity * 2;
+            spill_recipes = tracked_realloc(
+                    spill_recipes, spill_recipes_capacity * sizeof(uint32_t),
+                    capacity * sizeof(uint32_t), MEMORY_QUEUES);
+            spill_recipes_capacity = capacity;
         }
+        recipe->spill_slot = spill_recipes_count;
+        spill_recipes[spill_recipes_count++] = order.recipe;
+        recipe->spilled_quantity = order.quantity;
+    } else if (order.quantity < recipe->spilled_quantity)
+        recipe->spilled_quantity = order.quantity;
+    recipe->spilled_orders++;
+}
+
+// Moves to the spill file the waiting orders that arrived before the last
+// memory reclaim and that cannot be promoted by the current stock. The wait
+// queue has just been compacted, so it holds no tombstones.
+void spill_cold_orders() {
+    uint32_t cold = 0;
+
+    while (cold < orders_wait_queue.count &&
+           order_queue_at(&orders_wait_queue, cold)->order_timestamp <
+                   spill_horizon)
+        cold++;
+    spill_horizon = current_timestamp;
+    if (cold == 0)
+        return;
+
+    if (spill_count - spill_live > spill_live) {
+        uint32_t kept = 0;
+        for (uint32_t i = 0; i < spill_count; i++)
+            if (spill_orders[i].recipe != ORDER_TOMBSTONE)
+                spill_orders[kept++] = spill_orders[i];
+        spill_count = kept;
     }
+    spill_reserve(cold);
+
+    for (uint32_t i = 0; i < cold; i++) {
+        Order *order = order_queue_at(&orders_wait_queue, i);
+        if (!is_plausibly_feasible(recipe_table[order->recipe], order->quantity)) {
+            spill_order(*order);
+            order_queue_remove(&orders_wait_queue, i);
+        }
+    }
+    order_queue_compact(&orders_wait_queue, 1);
+    // the pages are written back to the file instead of staying resident
+    madvise(spill_orders, spill_capacity * sizeof(Order), MADV_DONTNEED);
+}
+
+int compare_order_timestamps(const void *first, const void *second) {
+    const Order *a = first, *b = second;
+
+    return (a->order_timestamp > b->order_timestamp) -
+           (a->order_timestamp < b->order_timestamp);
+}
+
+// Brings the spilled orders back into the wait queue, all of them or only those
+// of the recipes that the stock could now promote, at least for their smallest
+// quantity. The others would fail anyway, so leaving them out of the next
+// promotion changes neither which orders are promoted nor when.
+void spill_reload(int all) {
+    uint32_t first_reloading = spill_recipes_count;
+
+    for (uint32_t i = spill_recipes_count; i-- > 0;) {
+        Recipe *recipe = recipe_table[spill_recipes[i]];
+        if (!all && !is_plausibly_feasible(recipe, recipe->spilled_quantity))
+            continue;
+        // the recipes to reload gather at the end of the array
+        uint32_t handle = spill_recipes[--first_reloading];
+        spill_recipes[first_reloading] = spill_recipes[i];
+        spill_recipes[i] = handle;
+        recipe_table[handle]->spill_slot = i;
+        recipe->spill_slot = SPILL_RELOADING;
+    }
+    if (first_reloading == spill_recipes_count)
+        return;
 
-    if (is_ready) { // updating warehouse stocks for each ingredient of the order
-        // and eventually add it to the ready queue
-        ingredient = recipe->ingredients;
-        if (ingredient == NULL)
+    uint32_t reloaded = 0;
+    for (uint32_t i = first_reloading; i < spill_recipes_count; i++)
+        reloaded += recipe_table[spill_recipes[i]]->spilled_orders;
+    Order *orders = tracked_malloc(reloaded * sizeof(Order), MEMORY_QUEUES);
+
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < spill_count; i++) {
+        Order *order = &spill_orders[i];
+        if (order->recipe != ORDER_TOMBSTONE &&
+            recipe_table[order->recipe]->spill_slot == SPILL_RELOADING) {
+            orders[count++] = *order;
+            order->recipe = ORDER_TOMBSTONE;
+        }
+    }
+    qsort(orders, count, sizeof(Order), compare_order_timestamps);
+    for (uint32_t i = first_reloading; i < spill_recipes_count; i++) {
+        Recipe *recipe = recipe_table[spill_recipes[i]];
+        recipe->spilled_orders = 0;
+        recipe->spill_slot = SPILL_NONE;
+    }
+    spill_recipes_count = first_reloading;
+    spill_live -= count;
+    if (spill_live == 0)
+        spill_count = 0;
+    madvise(spill_orders, spill_capacity * sizeof(Order), MADV_DONTNEED);
+
+    // merged by arrival with the live waiting orders into a queue with room for
+    // both
+    OrderQueue merged = {NULL, ORDER_QUEUE_INITIAL_CAPACITY, 0, 0, 0};
+    while (merged.capacity < orders_wait_queue.live + count)
+        merged.capacity *= 2;
+    merged.orders = tracked_malloc(merged.capacity * sizeof(Order), MEMORY_QUEUES);
+    for (uint32_t i = 0, j = 0; i < orders_wait_queue.count || j < count;) {
+        Order *order = i < orders_wait_queue.count
+                               ? order_queue_at(&orders_wait_queue, i)
+                               : NULL;
+        if (order != NULL && order->recipe == ORDER_TOMBSTONE) {
+            i++;
+            continue;
+        }
+        if (order == NULL ||
+            (j < count && orders[j].order_timestamp < order->order_timestamp)) {
+            order_queue_push_back(&merged, orders[j++]);
+        } else {
+            order_queue_push_back(&merged, *order);
+            i++;
+        }
+    }
+    tracked_free(orders, reloaded * sizeof(Order), MEMORY_QUEUES);
+    tracked_free(orders_wait_queue.orders,
+                 orders_wait_queue.capacity * sizeof(Order), MEMORY_QUEUES);
+    orders_wait_queue = merged;
+}
+
+// Copies the spill file for a simulation, since the forked process would
+// otherwise share the mapping of this one: the copy is written from the
+// mapping, so the orders do not come back into memory
+FILE *spill_copy() {
+    FILE *copy = spill_create_file();
+    if (ftruncate(fileno(copy), spill_capacity * sizeof(Order)) != 0)
+        exit(1);
+
+    char *bytes = (char *)spill_orders;
+    size_t size = spill_count * sizeof(Order);
+    for (size_t written = 0; written < size;) {
+        ssize_t count = write(fileno(copy), bytes + written, size - written);
+        if (count < 0)
             exit(1);
-        while (ingredient != NULL) {
-
-            int32_t ingredient_total_qty = ingredient->quantity * order->quantity;
-            while (ingredient_total_qty > 0) {
-                Entry *entries = hashmap_get_entries(warehouse_tree, ingredient->name,
-                                                     ingredient->ing_index);
-                Entry *min = entries;
-                while (entries != NULL) {
-                    if (strcmp(entries->key, ingredient->name) == 0) {
-                        min = entries;
-                        break;
-                    }
-                    entries = entries->next;
-                }
+        written += count;
+    }
+    madvise(spill_orders, spill_capacity * sizeof(Order), MADV_DONTNEED);
+    return copy;
+}
 
-                if (((Lotto *)min->value)->ingredient_quantity >=
-                    ingredient_total_qty) {
-                    ((Lotto *)min->value)->ingredient_quantity -= ingredient_total_qty;
-                    ingredient_total_qty = 0;
-                } else {
-                    ingredient_total_qty -= ((Lotto *)min->value)->ingredient_quantity;
-                    ((Lotto *)min->value)->ingredient_quantity = 0;
-                }
-                if (((Lotto *)min->value)->ingredient_quantity == 0)
-                    hashmap_remove_entry(warehouse_tree, ingredient->name, min,
-                                         ingredient->ing_index);
-            }
-            ingredient = ingredient->next;
+// Maps the copy made by spill_copy in place of the file of the parent
+void spill_adopt(FILE *copy) {
+    munmap(spill_orders, spill_capacity * sizeof(Order));
+    fclose(spill_file);
+    spill_file = copy;
+    spill_orders = mmap(NULL, spill_capacity * sizeof(Order),
+                        PROT_READ | PROT_WRITE, MAP_SHARED, fileno(copy), 0);
+    if (spill_orders == MAP_FAILED)
+        exit(1);
+}
+
+// Leaves the file as it is: it is unlinked, so it goes away once every process
+// sharing it has closed it
+void spill_close() {
+    if (spill_file == NULL)
+        return;
+    munmap(spill_orders, spill_capacity * sizeof(Order));
+    fclose(spill_file);
+    spill_file = NULL;
+    spill_orders = NULL;
+    spill_capacity = 0;
+    spill_count = 0;
+    spill_live = 0;
+    tracked_free(spill_recipes, spill_recipes_capacity * sizeof(uint32_t),
+                 MEMORY_QUEUES);
+    spill_recipes = NULL;
+    spill_recipes_count = 0;
+    spill_recipes_capacity = 0;
+}
+
+// Orders the ingredients of a recipe by decreasing recent failure rate, so that
+// its most likely bottleneck is checked first
+void retune_recipe(Recipe *recipe) {
+    for (int32_t i = 1; i < recipe->ingredient_count; i++) {
+        Ingredient *ingredient = recipe->ingredients[i];
+        int32_t quantity = recipe->quantities[i];
+        int32_t j = i;
+
+        while (j > 0 && (int64_t)ingredient->failures *
+                                recipe->ingredients[j - 1]->probes >
+                        (int64_t)recipe->ingredients[j - 1]->failures *
+                                ingredient->probes) {
+            recipe->ingredients[j] = recipe->ingredients[j - 1];
+            recipe->quantities[j] = recipe->quantities[j - 1];
+            j--;
         }
-        add_order_to_ready_queue(order);
+        recipe->ingredients[j] = ingredient;
+        recipe->quantities[j] = quantity;
     }
 }
 
-int evaluate_shifting_order(char *order_name, int32_t order_qty,
-                            int32_t order_timestamp, size_t rec_index,
-                            Recipe *recipe) {
-    int is_ready = 1;
-    Ingredient *ingredient = recipe->ingredients;
+int is_known_infeasible(Recipe *recipe, int32_t order_qty) {
+    if (recipe->failed_quantity < 0 || order_qty < recipe->failed_quantity)
+        return 0;
 
-    if (ingredient == NULL)
+    for (int32_t i = 0; i < recipe->ingredient_count; i++)
+        if (recipe->ingredients[i]->version > recipe->failed_epoch)
+            return 0;
+    return 1;
+}
+
+// Without restocks the stock only decreases, so every quantity not smaller
+// than a failed one keeps failing
+void record_infeasible(Recipe *recipe, int32_t order_qty) {
+    recipe->failed_quantity = order_qty;
+    recipe->failed_epoch = restock_epoch;
+}
+
+int check_ingredients_availability(Recipe *recipe, int32_t order_qty) {
+    if (recipe->ingredient_count == 0)
         exit(1);
+    if (is_known_infeasible(recipe, order_qty))
+        return 0;
 
-    while (ingredient != NULL && is_ready) { // check availability and decide if
-        // order is ready or in wait state
-        int32_t ingredient_total_quantity = ingredient->quantity * order_qty;
+    int32_t needed[recipe->ingredient_count];
 
-        Entry *entries = hashmap_get_and_remove_expired_entries(
-                warehouse_tree, ingredient->name, ingredient->ing_index);
-        if (entries == NULL) {
-            is_ready = 0;
-        } else {
-            while (entries != NULL) {
-                if (strcmp(entries->key, ingredient->name) == 0) {
-                    if (((Lotto *)entries->value)->ingredient_quantity >=
-                        ingredient_total_quantity) {
-                        ingredient_total_quantity = 0;
-                        break;
-                    } else
-                        ingredient_total_quantity -=
-                                ((Lotto *)entries->value)->ingredient_quantity;
-                }
-                entries = entries->next;
+    if (++recipe->evaluations % RETUNE_PERIOD == 0)
+        retune_recipe(recipe);
+
+    for (int32_t i = 0; i < recipe->ingredient_count; i++)
+        needed[i] = recipe->quantities[i] * order_qty;
+
+    for (int32_t i = 0; i < recipe->ingredient_count; i++) {
+        Ingredient *ingredient = recipe->ingredients[i];
+        Lotto *lot =
+                ingredient_remove_expired_lots(ingredient, current_timestamp);
+
+        // halving the statistics keeps them representative of recent orders
+        if (++ingredient->probes == SCARCITY_WINDOW) {
+            ingredient->probes /= 2;
+            ingredient->failures /= 2;
+        }
+        if (lot == NULL) {
+            ingredient->failures++;
+            record_infeasible(recipe, order_qty);
+            return 0;
+        }
+        while (lot != NULL) {
+            if (lot->ingredient_quantity >= needed[i]) {
+                needed[i] = 0;
+                break;
             }
-            if (ingredient_total_quantity > 0)
-                is_ready = 0;
-            ingredient = ingredient->next;
+            needed[i] -= lot->ingredient_quantity;
+            lot = lot->next;
+            lots_touched++;
+        }
+        if (needed[i] > 0) {
+            ingredient->failures++;
+            record_infeasible(recipe, order_qty);
+            return 0;
         }
     }
+    return 1;
+}
 
-    if (is_ready) { // updating warehouse stocks for each ingredient of the order
-        // and eventually add it to the ready queue
-        ingredient = recipe->ingredients;
-        if (ingredient == NULL)
-            exit(1);
-        while (ingredient != NULL) {
-            int32_t ingredient_total_qty = ingredient->quantity * order_qty;
-
-            while (ingredient_total_qty > 0) {
-                Entry *entries = hashmap_get_entries(warehouse_tree, ingredient->name,
-                                                     ingredient->ing_index);
-                Entry *min = entries;
-                while (entries != NULL) {
-                    if (strcmp(entries->key, ingredient->name) == 0) {
-                        min = entries;
-                        break;
-                    }
-                    entries = entries->next;
-                }
-                if (((Lotto *)min->value)->ingredient_quantity >=
-                    ingredient_total_qty) {
-                    ((Lotto *)min->value)->ingredient_quantity -= ingredient_total_qty;
-                    ingredient_total_qty = 0;
-                } else {
-                    ingredient_total_qty -= ((Lotto *)min->value)->ingredient_quantity;
-                    ((Lotto *)min->value)->ingredient_quantity = 0;
-                }
-                if (((Lotto *)min->value)->ingredient_quantity == 0)
-                    hashmap_remove_entry(warehouse_tree, ingredient->name, min,
-                                         ingredient->ing_index);
-            }
-            ingredient = ingredient->next;
+// updating warehouse stocks for each ingredient of the order, consuming the
+// lots closest to expiration first
+void consume_ingredients(Recipe *recipe, int32_t order_qty) {
+    for (int32_t i = 0; i < recipe->ingredient_count; i++) {
+        int32_t ingredient_total_qty = recipe->quantities[i] * order_qty;
+        ingredient_consume(recipe->ingredients[i], ingredient_total_qty);
+    }
+}
+
+void ingredient_consume(Ingredient *ingredient, int64_t ingredient_total_qty) {
+    if (ingredient_total_qty > 0)
+        ingredient->stock -= ingredient_total_qty;
+    while (ingredient_total_qty > 0) {
+        Lotto *min = ingredient->lots;
+        lots_touched++;
+        if (min->ingredient_quantity >= ingredient_total_qty) {
+            min->ingredient_quantity -= ingredient_total_qty;
+            ingredient_total_qty = 0;
+        } else {
+            ingredient_total_qty -= min->ingredient_quantity;
+            min->ingredient_quantity = 0;
+        }
+        if (min->ingredient_quantity == 0) {
+            ingredient->lots = min->next;
+            tracked_free(min, sizeof(Lotto), MEMORY_WAREHOUSE);
         }
-        add_order_to_ready_queue(create_order_timestamp(
-                order_name, order_qty, order_timestamp, rec_index));
     }
-    return is_ready;
 }
 
-void add_order_to_wait_queue(Order *order) {
-    if (orders_wait_queue == NULL) {
-        orders_wait_queue = order;
-    } else {
-        orders_wait_queue_tail->next = order;
+// Adds the ingredients of the order to the batch, dropping their expired lots.
+// The batch is flushed first if one of its lots expired since it was started,
+// and the order cannot be batched if it needs none of an ingredient, since
+// then only the presence of a lot decides.
+int join_order_batch(Recipe *recipe, int32_t order_qty) {
+    for (int32_t i = 0; i < recipe->ingredient_count; i++) {
+        Ingredient *ingredient = recipe->ingredients[i];
+        if (recipe->quantities[i] * order_qty <= 0)
+            return 0;
+        if (ingredient->batch_horizon >= 0 &&
+            current_timestamp >= ingredient->batch_horizon)
+            flush_order_batch();
     }
+    if (recipe->ingredient_count == 0)
+        return 0;
 
-    orders_wait_queue_tail = order;
-    order->next = NULL;
+    for (int32_t i = 0; i < recipe->ingredient_count; i++) {
+        Ingredient *ingredient = recipe->ingredients[i];
+        if (ingredient->batch_horizon >= 0)
+            continue;
+
+        Lotto *lot =
+                ingredient_remove_expired_lots(ingredient, current_timestamp);
+        ingredient->batch_horizon =
+                lot == NULL ? INT32_MAX : lot->ingredient_expiration_date;
+        if (batch_ingredients_count == batch_ingredients_capacity) {
+            uint32_t capacity = batch_ingredients_capacity == 0
+                                        ? 16
+                                        : batch_ingredients_capacity * 2;
+            batch_ingredients = tracked_realloc(
+                    batch_ingredients,
+                    batch_ingredients_capacity * sizeof(Ingredient *),
+                    capacity * sizeof(Ingredient *), MEMORY_BUFFERS);
+            batch_ingredients_capacity = capacity;
+        }
+        batch_ingredients[batch_ingredients_count++] = ingredient;
+    }
+    batch_recipe = recipe;
+    return 1;
 }
 
-void add_order_to_ready_queue(Order *order) {
-    // adding orders in a timestamp-ordered queue
-    if (orders_ready_queue == NULL) {
-        orders_ready_queue = order;
+// Same decision and statistics as check_ingredients_availability, taken on the
+// stock left by the batch instead of walking the lots
+int check_batched_availability(Recipe *recipe, int32_t order_qty) {
+    if (is_known_infeasible(recipe, order_qty))
+        return 0;
+
+    if (++recipe->evaluations % RETUNE_PERIOD == 0)
+        retune_recipe(recipe);
+
+    for (int32_t i = 0; i < recipe->ingredient_count; i++) {
+        Ingredient *ingredient = recipe->ingredients[i];
+
+        if (++ingredient->probes == SCARCITY_WINDOW) {
+            ingredient->probes /= 2;
+            ingredient->failures /= 2;
+        }
+        if (ingredient->stock - ingredient->batch_consumption <
+            recipe->quantities[i] * order_qty) {
+            ingredient->failures++;
+            record_infeasible(recipe, order_qty);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Orders are decided one at a time as they arrive, but the lots they consume
+// are only taken when the batch is flushed, in one sweep per ingredient:
+// consuming the lots closest to expiration first gives the same lots whether
+// the quantities are taken one order at a time or all at once.
+void analyze_batched_order(Order order, Recipe *recipe) {
+    if (!join_order_batch(recipe, order.quantity)) {
+        flush_order_batch();
+        analyze_order(order, recipe);
         return;
     }
 
-    Order *iterator = orders_ready_queue;
-    Order *step_before_iterator = orders_ready_queue;
-
-    while (iterator != NULL &&
-           order->order_timestamp > iterator->order_timestamp) {
-        step_before_iterator = iterator;
-        iterator = iterator->next;
-    }
-
-    if (step_before_iterator != iterator) { // push_back
-        step_before_iterator->next = order;
-        order->next = iterator;
-    } else { // push_front
-        Order *aus = orders_ready_queue;
-        orders_ready_queue = order;
-        order->next = aus;
-    }
-}
-
-void add_order_to_shipment_queue(Order *order, Order *ready_queue_order) {
-    if (order != ready_queue_order) {
-        if (shipment_queue == NULL) { // empty queue
-            shipment_queue = order;
-            orders_ready_queue = orders_ready_queue->next;
-            order->next = NULL;
-        } else { // push_back
-            Order *shipment_iterator = shipment_queue;
-            Order *step_before_shipment_iterator = shipment_queue;
-
-            while (shipment_iterator != NULL &&
-                   get_order_heaviness(order) <=
-                   get_order_heaviness(shipment_iterator)) {
-                if (get_order_heaviness(order) ==
-                    get_order_heaviness(shipment_iterator)) {
-                    while (shipment_iterator != NULL &&
-                           get_order_heaviness(order) ==
-                           get_order_heaviness(shipment_iterator) &&
-                           order->order_timestamp > shipment_iterator->order_timestamp) {
-                        step_before_shipment_iterator = shipment_iterator;
-                        shipment_iterator = shipment_iterator->next;
-                    }
-                    break;
-                }
-                step_before_shipment_iterator = shipment_iterator;
-                shipment_iterator = shipment_iterator->next;
-            }
+    if (check_batched_availability(recipe, order.quantity)) {
+        for (int32_t i = 0; i < recipe->ingredient_count; i++)
+            recipe->ingredients[i]->batch_consumption +=
+                    recipe->quantities[i] * order.quantity;
+        add_order_to_ready_queue(order, recipe);
+    } else
+        add_order_to_wait_queue(order, recipe);
+}
 
-            if (step_before_shipment_iterator != shipment_iterator) {
-                step_before_shipment_iterator->next = order;
-                orders_ready_queue = orders_ready_queue->next;
-                order->next = shipment_iterator;
-            } else {
-                Order *aus = shipment_queue;
-                shipment_queue = order;
-                orders_ready_queue = orders_ready_queue->next;
-                order->next = aus;
-            }
-        }
+// Takes the consumption of the batch from the lots, before anything else
+// reads or changes them
+void flush_order_batch() {
+    for (uint32_t i = 0; i < batch_ingredients_count; i++) {
+        Ingredient *ingredient = batch_ingredients[i];
+        ingredient_consume(ingredient, ingredient->batch_consumption);
+        ingredient->batch_consumption = 0;
+        ingredient->batch_horizon = -1;
     }
+    batch_ingredients_count = 0;
+    batch_recipe = NULL;
+}
+
+void analyze_order(Order order, Recipe *recipe) {
+    // check availability and decide if order is ready or in wait state
+    if (check_ingredients_availability(recipe, order.quantity)) {
+        consume_ingredients(recipe, order.quantity);
+        add_order_to_ready_queue(order, recipe);
+    } else
+        add_order_to_wait_queue(order, recipe);
+}
+
+int evaluate_shifting_order(Order *order, Recipe *recipe) {
+    if (!check_ingredients_availability(recipe, order->quantity))
+        return 0;
+
+    consume_ingredients(recipe, order->quantity);
+    add_order_to_ready_queue(*order, recipe);
+    return 1;
+}
+
+// Keeps track of the ingredients a waiting order could be promoted by
+void update_waiting_orders(Recipe *recipe, int32_t delta) {
+    recipe->waiting_orders += delta;
+    for (int32_t i = 0; i < recipe->ingredient_count; i++)
+        recipe->ingredients[i]->waiting_orders += delta;
 }
 
-int get_order_heaviness(Order *order) {
-    int32_t total_heaviness = 0;
-    Ingredient *iterator = NULL;
-    Recipe *rec =
-            hashmap_get_recipe(catalog_tree, order->recipe_name, order->rec_index);
+void add_order_to_ready_queue(Order order, Recipe *recipe) {
+    uint32_t position = order_queue_insert_ordered(&orders_ready_queue, order);
 
-    if (rec != NULL)
-        iterator = rec->ingredients;
+    recipe->ready_orders++;
+    if (position >= shipment_count)
+        return;
 
-    while (iterator != NULL) {
-        total_heaviness += order->quantity * iterator->quantity;
-        iterator = iterator->next;
+    // an order older than some of the load: the load stays a prefix of the
+    // ready queue, so its newest orders leave until it fits again
+    shipment_insert(order);
+    shipment_count++;
+    shipment_weight += order.weight;
+    while (shipment_weight > courier_capacity) {
+        Order *newest = order_queue_at(&orders_ready_queue, --shipment_count);
+        shipment_weight -= newest->weight;
+        shipment_remove(newest);
     }
+}
+
+void add_order_to_wait_queue(Order order, Recipe *recipe) {
+    update_waiting_orders(recipe, 1);
+    order_queue_push_back(&orders_wait_queue, order);
+}
 
-    return total_heaviness;
+// Shipment order: heaviest first, then by arrival
+int compare_shipment_orders(const void *first, const void *second) {
+    const Order *a = first, *b = second;
+
+    if (a->weight != b->weight)
+        return a->weight < b->weight ? 1 : -1;
+    return (a->order_timestamp > b->order_timestamp) -
+           (a->order_timestamp < b->order_timestamp);
 }
 
 Carrier *create_carrier(int32_t periodicity, int32_t capacity) {
@@ -918,29 +2150,6 @@ Carrier *create_carrier(int32_t periodicity, int32_t capacity) {
     return car;
 }
 
-void destroy_ingredient(Ingredient *ingredient) {
-    if (ingredient == NULL)
-        return;
-    free(ingredient->name);
-    ingredient->name = NULL;
-    destroy_ingredient(ingredient->next);
-    ingredient->next = NULL;
-    free(ingredient);
-    ingredient = NULL;
-}
-
-void destroy_order(Order **order) {
-    if (order == NULL || *order == NULL)
-        return;
-    free((*order)->recipe_name);
-    (*order)->recipe_name = NULL;
-    destroy_order(&((*order)->next));
-    (*order)->next = NULL;
-    free(*order);
-    *order = NULL;
-    order = NULL;
-}
-
 Carrier *manage_carrier() {
     int new_line = 0;
     int periodicity = read_int(&new_line);
@@ -949,145 +2158,711 @@ Carrier *manage_carrier() {
     return carrier;
 }
 
-void manage_ingredients(Recipe *recipe, char *ingredient_name) {
+void parsed_ingredients_reserve(uint32_t count) {
+    uint32_t capacity = parsed_ingredients_capacity == 0
+                                ? 16
+                                : parsed_ingredients_capacity;
+
+    while (capacity < count)
+        capacity *= 2;
+    if (capacity == parsed_ingredients_capacity)
+        return;
+
+    parsed_ingredients = tracked_realloc(
+            parsed_ingredients, parsed_ingredients_capacity * sizeof(Ingredient *),
+            capacity * sizeof(Ingredient *), MEMORY_BUFFERS);
+    parsed_quantities = tracked_realloc(
+            parsed_quantities, parsed_ingredients_capacity * sizeof(int32_t),
+            capacity * sizeof(int32_t), MEMORY_BUFFERS);
+    parsed_ingredients_capacity = capacity;
+}
+
+Recipe *manage_ingredients(char *ingredient_name) {
+    uint32_t count = 0;
     int new_line = 0;
+
     while (new_line == 0 && (ingredient_name = read_word(&new_line))) {
-        int ingredient_quantity = read_int(&new_line);
-        add_ingredient_to_recipe(
-                recipe, create_ingredient(ingredient_name, ingredient_quantity));
+        parsed_ingredients_reserve(count + 1);
+        parsed_ingredients[count] =
+                get_ingredient(ingredient_name, hash(ingredient_name));
+        parsed_quantities[count] = read_int(&new_line);
+        count++;
     }
+    return compile_recipe(parsed_ingredients, parsed_quantities, count);
 }
 
-int seek_recipe_in_wait_list(char *recipe_name) {
-    int result = 0;
-    Order *iterator = orders_wait_queue;
+// The whole line is parsed before being applied: a restock that touches no
+// ingredient needed by a waiting order cannot promote any of them, so it is
+// coalesced with the pending promotion instead of rescanning the wait queue.
+// The lots are then sorted so that each ingredient gets all of its own merged
+// in one pass over its lot list.
+void manage_restock(int new_line) {
+    RestockLot *lots = parsed_lots;
+    uint32_t count = 0;
+    int is_relevant = 0;
+    char *ingredient_name;
 
-    while (iterator != NULL && !result) {
-        if (strcmp(iterator->recipe_name, recipe_name) == 0)
-            result = 1;
-        else
-            iterator = iterator->next;
+    while (new_line == 0 && (ingredient_name = read_word(&new_line))) {
+        if (count == parsed_lots_capacity) {
+            uint32_t capacity = count == 0 ? 16 : count * 2;
+            lots = parsed_lots = tracked_realloc(
+                    parsed_lots, count * sizeof(RestockLot),
+                    capacity * sizeof(RestockLot), MEMORY_BUFFERS);
+            parsed_lots_capacity = capacity;
+        }
+        if (count == 0)
+            flight_record_argument(ingredient_name, 0);
+        lots[count].ingredient =
+                get_ingredient(ingredient_name, hash(ingredient_name));
+        lots[count].quantity = read_int(&new_line);
+        lots[count].expiration_date = read_int(&new_line);
+        if (lots[count].ingredient->waiting_orders > 0)
+            is_relevant = 1;
+        count++;
+    }
+
+    // a promotion still pending must see the stock as it was before this
+    // restock, so it is resolved first
+    if (is_relevant)
+        resolve_pending_promotion();
+    qsort(lots, count, sizeof(RestockLot), compare_restock_lots);
+    for (uint32_t first = 0, last; first < count; first = last) {
+        Ingredient *ingredient = lots[first].ingredient;
+
+        last = first + 1;
+        while (last < count && lots[last].ingredient == ingredient)
+            last++;
+        // the merge supplies the ingredient iff its latest lot is not expired
+        // yet, which is known before merging: the epochs stay in restock order
+        // even when the merges run on the restock workers
+        if (lots[last - 1].expiration_date > current_timestamp)
+            ingredient->version = ++restock_epoch;
+        if (restock_shard_count == 0) {
+            ingredient_merge_lots(ingredient, lots + first, last - first,
+                                  current_timestamp);
+            continue;
+        }
+
+        RestockShard *shard = &restock_shards[ingredient->shard];
+        restock_batch_append(&shard->filling, lots + first, last - first,
+                             current_timestamp);
+        if (shard->filling.lot_count >= RESTOCK_SHARD_BATCH)
+            restock_shard_publish(shard);
+        restocks_pending = 1;
+    }
+    if (is_relevant)
+        pending_promotion_timestamp = current_timestamp;
+    flight_record_set_quantity(count);
+}
+
+void restock_batch_append(RestockBatch *batch, RestockLot *lots,
+                          uint32_t count, int32_t timestamp) {
+    if (batch->lot_count + count > batch->lot_capacity) {
+        uint32_t capacity = batch->lot_capacity == 0 ? 16 : batch->lot_capacity;
+        while (capacity < batch->lot_count + count)
+            capacity *= 2;
+        batch->lots = tracked_realloc(batch->lots,
+                                      batch->lot_capacity * sizeof(RestockLot),
+                                      capacity * sizeof(RestockLot),
+                                      MEMORY_BUFFERS);
+        batch->lot_capacity = capacity;
+    }
+    if (batch->group_count == batch->group_capacity) {
+        uint32_t capacity =
+                batch->group_capacity == 0 ? 16 : batch->group_capacity * 2;
+        batch->groups = tracked_realloc(
+                batch->groups, batch->group_capacity * sizeof(RestockGroup),
+                capacity * sizeof(RestockGroup), MEMORY_BUFFERS);
+        batch->group_capacity = capacity;
+    }
+
+    memcpy(batch->lots + batch->lot_count, lots, count * sizeof(RestockLot));
+    batch->lot_count += count;
+    batch->groups[batch->group_count].end = batch->lot_count;
+    batch->groups[batch->group_count].timestamp = timestamp;
+    batch->group_count++;
+}
+
+void restock_batch_free(RestockBatch *batch) {
+    tracked_free(batch->lots, batch->lot_capacity * sizeof(RestockLot),
+                 MEMORY_BUFFERS);
+    tracked_free(batch->groups, batch->group_capacity * sizeof(RestockGroup),
+                 MEMORY_BUFFERS);
+    memset(batch, 0, sizeof(RestockBatch));
+}
+
+// Splits the warehouse into shards, by ingredient hash, each with its worker
+void restock_shards_start(uint32_t count) {
+    restock_shards = tracked_calloc(count, sizeof(RestockShard), MEMORY_BUFFERS);
+    restock_shard_count = count;
+
+    for (uint32_t i = 0; i < count; i++) {
+        RestockShard *shard = &restock_shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        pthread_cond_init(&shard->changed, NULL);
+        if (pthread_create(&shard->thread, NULL, restock_worker_run, shard) != 0)
+            exit(1);
+    }
+}
+
+void restock_shards_stop() {
+    restock_barrier();
+    for (uint32_t i = 0; i < restock_shard_count; i++) {
+        RestockShard *shard = &restock_shards[i];
+
+        pthread_mutex_lock(&shard->lock);
+        shard->is_stopping = 1;
+        pthread_cond_broadcast(&shard->changed);
+        pthread_mutex_unlock(&shard->lock);
+        pthread_join(shard->thread, NULL);
+        pthread_mutex_destroy(&shard->lock);
+        pthread_cond_destroy(&shard->changed);
+        restock_batch_free(&shard->filling);
+        restock_batch_free(&shard->applying);
     }
+    tracked_free(restock_shards, restock_shard_count * sizeof(RestockShard),
+                 MEMORY_BUFFERS);
+    restock_shards = NULL;
+    restock_shard_count = 0;
+}
 
-    return result;
+// Hands the filled batch to the worker, once it is done with the previous one
+void restock_shard_publish(RestockShard *shard) {
+    pthread_mutex_lock(&shard->lock);
+    while (shard->is_applying)
+        pthread_cond_wait(&shard->changed, &shard->lock);
+
+    RestockBatch applied = shard->applying;
+    shard->applying = shard->filling;
+    shard->filling = applied;
+    shard->filling.lot_count = 0;
+    shard->filling.group_count = 0;
+    shard->is_applying = 1;
+    pthread_cond_broadcast(&shard->changed);
+    pthread_mutex_unlock(&shard->lock);
 }
 
-int seek_recipe_in_ready_list(char *recipe_name) {
-    int result = 0;
-    Order *iterator = orders_ready_queue;
+// Waits for every restock read so far to be merged into the warehouse
+void restock_barrier() {
+    if (!restocks_pending)
+        return;
+    restocks_pending = 0;
+
+    for (uint32_t i = 0; i < restock_shard_count; i++)
+        if (restock_shards[i].filling.group_count > 0)
+            restock_shard_publish(&restock_shards[i]);
+    for (uint32_t i = 0; i < restock_shard_count; i++) {
+        RestockShard *shard = &restock_shards[i];
+
+        pthread_mutex_lock(&shard->lock);
+        while (shard->is_applying)
+            pthread_cond_wait(&shard->changed, &shard->lock);
+        memory_account_deferred(shard->allocated);
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+void *restock_worker_run(void *argument) {
+    RestockShard *shard = argument;
 
-    while (iterator != NULL && !result) {
-        if (strcmp(iterator->recipe_name, recipe_name) == 0)
-            result = 1;
+    memory_deferred = shard->allocated;
+    pthread_mutex_lock(&shard->lock);
+    for (;;) {
+        while (!shard->is_applying && !shard->is_stopping)
+            pthread_cond_wait(&shard->changed, &shard->lock);
+        if (!shard->is_applying)
+            break;
+        pthread_mutex_unlock(&shard->lock);
+
+        RestockBatch *batch = &shard->applying;
+        for (uint32_t i = 0, first = 0; i < batch->group_count; i++) {
+            ingredient_merge_lots(batch->lots[first].ingredient,
+                                  batch->lots + first,
+                                  batch->groups[i].end - first,
+                                  batch->groups[i].timestamp);
+            first = batch->groups[i].end;
+        }
+
+        pthread_mutex_lock(&shard->lock);
+        shard->is_applying = 0;
+        pthread_cond_broadcast(&shard->changed);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return NULL;
+}
+
+// Position of the order in the load, or where it would go. Orders have distinct
+// timestamps, so each one has its own position.
+uint32_t shipment_search(Order *order) {
+    uint32_t low = 0, high = shipment_count;
+
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        if (compare_shipment_orders(&shipment[middle], order) < 0)
+            low = middle + 1;
         else
-            iterator = iterator->next;
+            high = middle;
+    }
+    return low;
+}
+
+// Only the array: the count and the weight of the load are up to the caller
+void shipment_insert(Order order) {
+    if (shipment_count == shipment_capacity) {
+        uint32_t capacity = shipment_capacity == 0 ? ORDER_QUEUE_INITIAL_CAPACITY
+                                                   : shipment_capacity * 2;
+        shipment = tracked_realloc(shipment, shipment_capacity * sizeof(Order),
+                                   capacity * sizeof(Order), MEMORY_QUEUES);
+        shipment_capacity = capacity;
     }
 
-    return result;
+    uint32_t position = shipment_search(&order);
+    memmove(&shipment[position + 1], &shipment[position],
+            (shipment_count - position) * sizeof(Order));
+    shipment[position] = order;
 }
 
-void print_carrier_content(int32_t carrier_capacity) {
-    int32_t current_weight = 0;
-    Order *step_before_iterator = orders_ready_queue;
-    Order *iterator = orders_ready_queue;
+// Called with the count already decreased
+void shipment_remove(Order *order) {
+    uint32_t position = shipment_search(order);
+    memmove(&shipment[position], &shipment[position + 1],
+            (shipment_count - position) * sizeof(Order));
+}
+
+// Loads up to steps more ready orders, stopping at the first that does not fit
+void prepare_shipment(uint32_t steps) {
+    while (steps-- > 0 && shipment_count < orders_ready_queue.count) {
+        Order *order = order_queue_at(&orders_ready_queue, shipment_count);
+        if (shipment_weight + order->weight > courier_capacity)
+            return;
+        shipment_insert(*order);
+        shipment_count++;
+        shipment_weight += order->weight;
+    }
+}
+
+// Drops the prepared load, for instance when the courier capacity changes
+void reset_shipment() {
+    shipment_count = 0;
+    shipment_weight = 0;
+}
 
-    if (iterator == NULL) {
+void print_carrier_content() {
+    if (orders_ready_queue.count == 0) {
         printf("camioncino vuoto\n");
         fflush(stdout);
         return;
     }
 
-    while (iterator != NULL) {
-        if (current_weight + get_order_heaviness(iterator) <= carrier_capacity) {
-            current_weight += get_order_heaviness(iterator);
+    // the oldest ready orders as long as they fit, already in shipment order
+    prepare_shipment(UINT32_MAX);
+    order_queue_pop_front(&orders_ready_queue, shipment_count);
+    orders_scanned += shipment_count;
 
-            add_order_to_shipment_queue(step_before_iterator, iterator);
+    for (uint32_t i = 0; i < shipment_count; i++) {
+        recipe_table[shipment[i].recipe]->ready_orders--;
+        printf("%d %s %d\n", shipment[i].order_timestamp,
+               recipe_table[shipment[i].recipe]->name, shipment[i].quantity);
+        fflush(stdout);
+    }
+    reset_shipment();
+}
 
-            step_before_iterator = iterator;
-            iterator = iterator->next;
-        } else
-            break;
+// Linear sweep over the wait queue in arrival order: the promoted orders leave
+// a tombstone behind
+void shift_orders_from_wait_to_ready_queue() {
+    if (spill_recipes_count > 0)
+        spill_reload(0);
+    for (uint32_t i = 0; i < orders_wait_queue.count; i++) {
+        Order *wait_order = order_queue_at(&orders_wait_queue, i);
+        if (wait_order->recipe == ORDER_TOMBSTONE)
+            continue;
+        orders_scanned++;
+
+        Recipe *rec = recipe_table[wait_order->recipe];
+        if (evaluate_shifting_order(wait_order, rec)) {
+            update_waiting_orders(rec, -1);
+            order_queue_remove(&orders_wait_queue, i);
+        }
     }
-    add_order_to_shipment_queue(step_before_iterator, iterator);
 
-    Order *shipment_iterator = shipment_queue;
-    Order *order = NULL;
-    while (shipment_iterator != NULL) {
+    order_queue_compact(&orders_wait_queue, 0);
+}
+
+// Runs the wait queue promotion deferred by the last relevant restock, as of
+// the time of that restock. Only commands after it that leave the stock of the
+// waiting orders' ingredients untouched can have run in between, so the
+// outcome is the same as promoting eagerly.
+void resolve_pending_promotion() {
+    if (pending_promotion_timestamp < 0)
+        return;
+
+    restock_barrier();
+    int32_t timestamp = current_timestamp;
+    current_timestamp = pending_promotion_timestamp;
+    pending_promotion_timestamp = -1;
+    shift_orders_from_wait_to_ready_queue();
+    current_timestamp = timestamp;
+}
+
+// Quantity still usable: the expired lots are dropped first
+int64_t ingredient_stock(Ingredient *ingredient) {
+    ingredient_remove_expired_lots(ingredient, current_timestamp);
+    return ingredient->stock;
+}
 
-        printf("%d %s %d\n", shipment_iterator->order_timestamp,
-               shipment_iterator->recipe_name, shipment_iterator->quantity);
+// The queries see the wait queue promotion deferred by the last restock as
+// already done, as the next order would
+void query_stock(char *ingredient_name) {
+    Ingredient *ingredient = hashmap_get_recipe(warehouse_tree, ingredient_name,
+                                                hash(ingredient_name));
+
+    resolve_pending_promotion();
+    printf("%lld\n", ingredient == NULL
+                             ? 0LL
+                             : (long long)ingredient_stock(ingredient));
+    fflush(stdout);
+}
+
+// Largest quantity an order could be prepared with right now
+void query_producible(char *recipe_name) {
+    Recipe *recipe =
+            hashmap_get_recipe(catalog_tree, recipe_name, hash(recipe_name));
+
+    if (recipe == NULL) {
+        printf("non presente\n");
         fflush(stdout);
+        return;
+    }
+    resolve_pending_promotion();
+
+    int64_t producible = INT32_MAX;
+    for (int32_t i = 0; i < recipe->ingredient_count; i++) {
+        int64_t stock = ingredient_stock(recipe->ingredients[i]);
+        // like an order, an ingredient out of stock is missing even if unused
+        int64_t units = recipe->ingredients[i]->lots == NULL ? 0
+                        : recipe->quantities[i] == 0
+                                ? INT32_MAX
+                                : stock / recipe->quantities[i];
+        if (units < producible)
+            producible = units;
+    }
+    printf("%lld\n", (long long)producible);
+    fflush(stdout);
+}
 
-        order = shipment_iterator;
-        shipment_iterator = shipment_iterator->next;
+// Orders of the recipe waiting for ingredients and ready for the courier
+void query_queue(char *recipe_name) {
+    Recipe *recipe =
+            hashmap_get_recipe(catalog_tree, recipe_name, hash(recipe_name));
 
-        if (order == NULL)
-            exit(1);
-        free(order->recipe_name);
-        order->recipe_name = NULL;
-        order->next = NULL;
-        free(order);
-        order = NULL;
+    if (recipe == NULL) {
+        printf("non presente\n");
+        fflush(stdout);
+        return;
     }
-    shipment_queue = NULL;
+    resolve_pending_promotion();
+    printf("%d %d\n", recipe->waiting_orders, recipe->ready_orders);
+    fflush(stdout);
 }
 
-void shift_orders_from_wait_to_ready_queue() {
-    Order *wait_order = orders_wait_queue;
-    Order *prec_wait_order = NULL;
-    HashMapInt *wait_map = hashmap_int_create();
-
-    while (wait_order != NULL) {
-        int wait_map_entry = hashmap_int_get_recipe(
-                wait_map, wait_order->recipe_name, wait_order->rec_index);
-
-        if (wait_map_entry != -1) {
-            if (wait_order->quantity >= wait_map_entry) {
-                prec_wait_order = wait_order;
-                wait_order = wait_order->next;
+// Loads the catalog file, one aggiungi_ricetta command per line, as if the
+// commands were issued in order before the first one of the input, without
+// printing anything and without taking time. Worker threads split the lines,
+// hash the names and compile the recipes; the main thread in between decides
+// in file order which recipes are added, so that the first of two with the
+// same name wins, and looks their ingredients up. Only the registration of the
+// compiled recipes is left for last, again in file order.
+void preload_catalog(char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "cannot open catalog file %s\n", path);
+        exit(1);
+    }
+
+    size_t size = 0, capacity = 1 << 16, read;
+    char *text = tracked_malloc(capacity, MEMORY_BUFFERS);
+    while ((read = fread(text + size, 1, capacity - size - 1, file)) > 0) {
+        size += read;
+        if (size == capacity - 1) {
+            text = tracked_realloc(text, capacity, capacity * 2, MEMORY_BUFFERS);
+            capacity *= 2;
+        }
+    }
+    fclose(file);
+    text[size] = '\0';
+
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t worker_count = size / PRELOAD_MIN_BYTES_PER_WORKER;
+    if (online > 0 && worker_count > (uint32_t)online)
+        worker_count = online;
+    if (worker_count > PRELOAD_MAX_WORKERS)
+        worker_count = PRELOAD_MAX_WORKERS;
+    if (worker_count == 0)
+        worker_count = 1;
+
+    // each range starts at the beginning of a line, found here so that the
+    // workers never look at the bytes of another range
+    PreloadWorker workers[PRELOAD_MAX_WORKERS];
+    for (uint32_t i = 0; i < worker_count; i++) {
+        size_t begin = size * i / worker_count;
+        while (begin > 0 && begin < size && text[begin - 1] != '\n')
+            begin++;
+        memset(&workers[i], 0, sizeof(PreloadWorker));
+        workers[i].text = text;
+        workers[i].begin = begin;
+        if (i > 0)
+            workers[i - 1].end = begin;
+    }
+    workers[worker_count - 1].end = size;
+    preload_run_workers(workers, worker_count, preload_worker_parse);
+
+    // the placeholder put in the catalog for a recipe to be added makes the
+    // later recipes with the same name ignored
+    for (uint32_t i = 0, line_number = 1; i < worker_count; i++) {
+        for (uint32_t j = 0; j < workers[i].count; j++, line_number++) {
+            PreloadRecipe *line = &workers[i].recipes[j];
+
+            if (line->name == NULL)
                 continue;
+            if (line->ingredient_count < 0) {
+                fprintf(stderr, "catalog file %s, line %u: not a recipe\n",
+                        path, line_number);
+                exit(1);
             }
+            if (hashmap_get_recipe(catalog_tree, line->name, line->index) != NULL)
+                continue;
+            line->entry =
+                    hashmap_put_recipes(catalog_tree, line->name, line, line->index);
+            line->ingredients =
+                    (Ingredient **)(line->quantities + line->ingredient_count);
+            for (int32_t k = 0; k < line->ingredient_count; k++)
+                line->ingredients[k] = get_ingredient(
+                        line->ingredient_names[k], line->ingredient_indexes[k]);
         }
+    }
+    preload_run_workers(workers, worker_count, preload_worker_compile);
 
-        Recipe *rec = hashmap_get_recipe(catalog_tree, wait_order->recipe_name,
-                                         wait_order->rec_index);
-        if (rec != NULL) {
-            if (evaluate_shifting_order(wait_order->recipe_name, wait_order->quantity,
-                                        wait_order->order_timestamp,
-                                        wait_order->rec_index, rec)) {
-                Order *aus = wait_order;
-
-                if (prec_wait_order == NULL) {
-                    orders_wait_queue = orders_wait_queue->next;
-                    prec_wait_order = NULL;
-                    wait_order = wait_order->next;
-                } else {
-                    prec_wait_order->next = wait_order->next;
-                    wait_order = wait_order->next;
-                }
-
-                free(aus->recipe_name);
-                aus->recipe_name = NULL;
-                aus->next = NULL;
-                free(aus);
-                aus = NULL;
-            } else {
-                hashmap_int_put_recipes(wait_map, wait_order->recipe_name,
-                                        wait_order->quantity, wait_order->rec_index);
+    for (uint32_t i = 0; i < worker_count; i++) {
+        for (uint32_t j = 0; j < workers[i].count; j++) {
+            PreloadRecipe *line = &workers[i].recipes[j];
 
-                prec_wait_order = wait_order;
-                wait_order = wait_order->next;
+            if (line->recipe != NULL) {
+                register_recipe(line->recipe);
+                line->entry->value = line->recipe;
             }
-        } else {
-            prec_wait_order = wait_order;
-            wait_order = wait_order->next;
-            exit(1);
+            if (line->ingredient_names != NULL)
+                tracked_free(line->ingredient_names,
+                             preload_recipe_size(line->ingredient_count),
+                             MEMORY_BUFFERS);
+        }
+        tracked_free(workers[i].recipes,
+                     workers[i].capacity * sizeof(PreloadRecipe), MEMORY_BUFFERS);
+    }
+    tracked_free(text, capacity, MEMORY_BUFFERS);
+}
+
+// The first worker runs on the main thread, as do those that could not be
+// started
+void preload_run_workers(PreloadWorker *workers, uint32_t count,
+                         void *(*run)(void *)) {
+    for (uint32_t i = 1; i < count; i++)
+        if (pthread_create(&workers[i].thread, NULL, run, &workers[i]) != 0)
+            workers[i].thread = pthread_self();
+    run(&workers[0]);
+    for (uint32_t i = 1; i < count; i++) {
+        if (pthread_equal(workers[i].thread, pthread_self()))
+            run(&workers[i]);
+        else
+            pthread_join(workers[i].thread, NULL);
+    }
+    for (uint32_t i = 0; i < count; i++)
+        memory_account_deferred(workers[i].allocated);
+}
+
+// Ingredient names, indexes, quantities and records of a catalog line
+size_t preload_recipe_size(int32_t ingredient_count) {
+    return ingredient_count * (sizeof(char *) + sizeof(size_t) + sizeof(int32_t) +
+                               sizeof(Ingredient *));
+}
+
+// Splits the line in place into the recipe name and its ingredient pairs, with
+// the names cut to the length the commands are read with
+void preload_parse_recipe(char *line, PreloadRecipe *recipe) {
+    char *words[2 * MAX_LENGTH], **names = words;
+    uint32_t count = 0, capacity = 2 * MAX_LENGTH;
+
+    recipe->name = NULL;
+    recipe->ingredient_count = 0;
+    recipe->ingredient_names = NULL;
+    recipe->ingredients = NULL;
+    recipe->recipe = NULL;
+    for (char *c = line; *c != '\0';) {
+        while (isspace((unsigned char)*c))
+            c++;
+        if (*c == '\0')
+            break;
+        if (count == capacity) {
+            char **grown = malloc(2 * capacity * sizeof(char *));
+            if (grown == NULL)
+                exit(1);
+            memcpy(grown, names, count * sizeof(char *));
+            if (names != words)
+                free(names);
+            names = grown;
+            capacity *= 2;
         }
+        names[count++] = c;
+        char *word = c;
+        while (*c != '\0' && !isspace((unsigned char)*c))
+            c++;
+        if (*c != '\0')
+            *c++ = '\0';
+        if (strlen(word) > MAX_LENGTH - 1)
+            word[MAX_LENGTH - 1] = '\0';
+    }
+
+    if (count == 0)
+        return;
+    recipe->ingredient_count = -1;
+    if (count < 2 || strcmp(names[0], "aggiungi_ricetta") != 0) {
+        recipe->name = names[0];
+        if (names != words)
+            free(names);
+        return;
     }
 
-    if (wait_order == NULL) {
-        orders_wait_queue_tail = prec_wait_order;
+    int32_t ingredient_count = (count - 1) / 2;
+    void *block =
+            tracked_malloc(preload_recipe_size(ingredient_count), MEMORY_BUFFERS);
+    recipe->name = names[1];
+    recipe->index = hash(names[1]);
+    recipe->ingredient_count = ingredient_count;
+    recipe->ingredient_names = block;
+    recipe->ingredient_indexes =
+            (size_t *)(recipe->ingredient_names + ingredient_count);
+    recipe->quantities = (int32_t *)(recipe->ingredient_indexes + ingredient_count);
+
+    for (int32_t j = 0; j < ingredient_count; j++) {
+        char *name = names[2 + 2 * j];
+        int32_t quantity = 0;
+
+        if (3 + 2 * j < (int32_t)count)
+            for (char *digit = names[3 + 2 * j]; isdigit((unsigned char)*digit);
+                 digit++)
+                quantity = quantity * 10 + (*digit - '0');
+        recipe->ingredient_names[j] = name;
+        recipe->ingredient_indexes[j] = hash(name);
+        recipe->quantities[j] = quantity;
     }
+    if (names != words)
+        free(names);
+}
+
+void *preload_worker_parse(void *argument) {
+    PreloadWorker *worker = argument;
+    char *line = worker->text + worker->begin;
+    char *end = worker->text + worker->end;
+
+    memory_deferred = worker->allocated;
+    while (line < end) {
+        char *line_end = memchr(line, '\n', end - line);
+        if (line_end == NULL)
+            line_end = end;
+        *line_end = '\0';
+        if (worker->count == worker->capacity) {
+            uint32_t capacity = worker->capacity == 0 ? 256 : worker->capacity * 2;
+            worker->recipes = tracked_realloc(
+                    worker->recipes, worker->capacity * sizeof(PreloadRecipe),
+                    capacity * sizeof(PreloadRecipe), MEMORY_BUFFERS);
+            worker->capacity = capacity;
+        }
+        preload_parse_recipe(line, &worker->recipes[worker->count++]);
+        line = line_end + 1;
+    }
+    memory_deferred = NULL;
+    return NULL;
+}
+
+// Compiles the recipes the main thread resolved the ingredients of
+void *preload_worker_compile(void *argument) {
+    PreloadWorker *worker = argument;
+
+    memory_deferred = worker->allocated;
+    for (uint32_t i = 0; i < worker->count; i++) {
+        PreloadRecipe *line = &worker->recipes[i];
+
+        if (line->ingredients == NULL)
+            continue;
+        line->recipe = compile_recipe(line->ingredients, line->quantities,
+                                      line->ingredient_count);
+        strcpy(line->recipe->name, line->name);
+    }
+    memory_deferred = NULL;
+    return NULL;
+}
+
+// Forks the shop: the child returns 0 and runs the commands of the file against
+// its copy of the state, writing what it prints to the output file, while the
+// parent returns the pid of the child, or -1 if it could not be started. The
+// courier of the simulation can be given another capacity.
+int start_simulation(Carrier *carrier, char *commands_path, char *output_path,
+                     int32_t capacity) {
+    FILE *commands = fopen(commands_path, "r");
+    if (commands == NULL) {
+        fprintf(stderr, "cannot open simulation commands %s\n", commands_path);
+        return -1;
+    }
+    FILE *output = fopen(output_path, "w");
+    if (output == NULL) {
+        fprintf(stderr, "cannot open simulation output %s\n", output_path);
+        fclose(commands);
+        return -1;
+    }
+
+    // the spilled orders stay spilled in both processes, each with its own file
+    FILE *spill = spill_file != NULL ? spill_copy() : NULL;
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(fileno(output), STDOUT_FILENO);
+        fclose(output);
+        input_stream = commands;
+        is_simulation = 1;
+        // the counters keep measuring the parent, and the restock workers
+        // stay there too: the simulation restocks sequentially
+        profiling = 0;
+        restock_shard_count = 0;
+        if (spill != NULL)
+            spill_adopt(spill);
+        running_simulations = 0;
+        // the dumps of the slow commands go to files of their own
+        if (trace_prefix != NULL) {
+            static char simulation_trace_prefix[PATH_MAX];
+            snprintf(simulation_trace_prefix, PATH_MAX, "%s-%d", trace_prefix,
+                     (int)getpid());
+            trace_prefix = simulation_trace_prefix;
+        }
+        carrier->capacity = capacity;
+        courier_capacity = capacity;
+        reset_shipment();
+        return 0;
+    }
+    fclose(commands);
+    fclose(output);
+    if (spill != NULL)
+        fclose(spill);
+    if (pid < 0) {
+        fprintf(stderr, "cannot start simulation %s\n", commands_path);
+        return -1;
+    }
+    running_simulations++;
+    return pid;
+}
 
-    hashmap_int_free(wait_map);
+// Collects the simulations that have ended, waiting for all of them unless
+// WNOHANG is given
+void reap_simulations(int options) {
+    while (running_simulations > 0 && waitpid(-1, NULL, options) > 0)
+        running_simulations--;
 }